@@ -45,6 +45,10 @@
             (import ./src/pkgs/micropython.nix pkgs)
           ]);
 
+          # Run `hyperfs-mock --passthrough-path=DIR MOUNTPOINT`, then
+          # `hyperfs-bench MOUNTPOINT`
+          hyperfs-bench = pkgs.callPackage ./src/pkgs/hyperfs/bench { };
+
           default = all-archs;
         };
     };
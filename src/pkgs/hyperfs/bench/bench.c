@@ -0,0 +1,423 @@
+/*
+ * HyperFS: Hypervisor-managed filesystem
+ * Copyright (C) 2024 Massachusetts Institute of Technology
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ * USA
+ */
+
+// Benchmark driver for a mounted hyperfs, normally one backed by the mock
+// host in mock_host.c. Each workload runs for a fixed time on every thread,
+// and its throughput and latency percentiles are printed.
+//
+//   hyperfs-bench [-t SECONDS] [-j THREADS] [-w WORKLOAD] MOUNTPOINT
+//
+// Hyperfiles are found by walking MOUNTPOINT/mock. Passthrough workloads use
+// a scratch directory created under MOUNTPOINT and removed afterwards.
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+  NUM_SCRATCH_FILES = 256,
+  SMALL_READ_SIZE = 4096,
+  LARGE_IO_SIZE = 128 << 10,
+  DATA_FILE_SIZE = 16 << 20,
+};
+
+struct worker {
+  const struct workload *workload;
+  unsigned int seed;
+  int large_fd, data_fd;
+  off_t offset;
+  char *buf;
+  // Latency of every op, in ns
+  uint64_t *samples;
+  size_t num_samples, cap_samples;
+  unsigned long errors;
+  unsigned long long bytes;
+};
+
+struct workload {
+  const char *name;
+  bool needs_hyperfiles;
+  int (*op)(struct worker *w);
+};
+
+static const char *mount_path;
+// Kept short enough that paths built from them can't be truncated
+static char mock_path[PATH_MAX / 2], scratch_path[PATH_MAX / 2];
+static char large_path[PATH_MAX], data_path[PATH_MAX];
+static char **hyperfiles;
+static size_t num_hyperfiles;
+static double duration = 2;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void find_hyperfiles(const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    return;
+  }
+  struct dirent *de;
+  while ((de = readdir(d))) {
+    if (de->d_name[0] == '.') {
+      continue;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    struct stat st;
+    if (stat(path, &st)) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      find_hyperfiles(path);
+    } else if (strcmp(path, large_path)) {
+      hyperfiles = realloc(hyperfiles, (num_hyperfiles + 1) * sizeof(char *));
+      hyperfiles[num_hyperfiles++] = strdup(path);
+    }
+  }
+  closedir(d);
+}
+
+static const char *random_hyperfile(struct worker *w) {
+  return hyperfiles[rand_r(&w->seed) % num_hyperfiles];
+}
+
+static int stat_hyperfile(struct worker *w) {
+  struct stat st;
+  return stat(random_hyperfile(w), &st);
+}
+
+static int stat_passthrough(struct worker *w) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/f%d", scratch_path,
+           rand_r(&w->seed) % NUM_SCRATCH_FILES);
+  struct stat st;
+  return stat(path, &st);
+}
+
+// Lookups of paths that don't exist are common when firmware probes for
+// optional files
+static int stat_missing(struct worker *w) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/missing%d", mock_path, rand_r(&w->seed));
+  struct stat st;
+  return !stat(path, &st) || errno != ENOENT;
+}
+
+// Needs HYPERFS_MOCK_PATTERNS, so the host matches these with a pattern
+// rather than listing them
+static int stat_pattern(struct worker *w) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/tty%d", mock_path,
+           rand_r(&w->seed) % 65536);
+  struct stat st;
+  return stat(path, &st);
+}
+
+static int walk(const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    return -1;
+  }
+  int ret = 0;
+  struct dirent *de;
+  while ((de = readdir(d))) {
+    if (de->d_type == DT_DIR && de->d_name[0] != '.') {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+      ret |= walk(path);
+    }
+  }
+  closedir(d);
+  return ret;
+}
+
+static int readdir_tree(struct worker *w) {
+  (void)w;
+  return walk(mock_path);
+}
+
+static int read_small(struct worker *w) {
+  int fd = open(random_hyperfile(w), O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t n = read(fd, w->buf, SMALL_READ_SIZE);
+  close(fd);
+  if (n < 0) {
+    return -1;
+  }
+  w->bytes += n;
+  return 0;
+}
+
+static int read_large(struct worker *w) {
+  ssize_t n = pread(w->large_fd, w->buf, LARGE_IO_SIZE, w->offset);
+  if (n < 0) {
+    return -1;
+  }
+  w->offset = n < LARGE_IO_SIZE ? 0 : w->offset + n;
+  w->bytes += n;
+  return 0;
+}
+
+static off_t random_data_offset(struct worker *w) {
+  return (off_t)(rand_r(&w->seed) % (DATA_FILE_SIZE / LARGE_IO_SIZE)) *
+         LARGE_IO_SIZE;
+}
+
+static int passthrough_read(struct worker *w) {
+  ssize_t n = pread(w->data_fd, w->buf, LARGE_IO_SIZE, random_data_offset(w));
+  if (n < 0) {
+    return -1;
+  }
+  w->bytes += n;
+  return 0;
+}
+
+static int passthrough_write(struct worker *w) {
+  ssize_t n = pwrite(w->data_fd, w->buf, LARGE_IO_SIZE, random_data_offset(w));
+  if (n < 0) {
+    return -1;
+  }
+  w->bytes += n;
+  return 0;
+}
+
+static const struct workload workloads[] = {
+    {"stat-hyperfile", true, stat_hyperfile},
+    {"stat-passthrough", false, stat_passthrough},
+    {"stat-missing", false, stat_missing},
+    {"stat-pattern", false, stat_pattern},
+    {"readdir-tree", true, readdir_tree},
+    {"read-small", true, read_small},
+    {"read-large", true, read_large},
+    {"passthrough-read", false, passthrough_read},
+    {"passthrough-write", false, passthrough_write},
+};
+
+static void *run_worker(void *arg) {
+  struct worker *w = arg;
+  uint64_t now = now_ns();
+  uint64_t end = now + duration * 1e9;
+  while (now < end) {
+    uint64_t start = now;
+    if (w->workload->op(w)) {
+      w->errors++;
+    }
+    now = now_ns();
+    if (w->num_samples == w->cap_samples) {
+      w->cap_samples = w->cap_samples ? w->cap_samples * 2 : 4096;
+      w->samples = realloc(w->samples, w->cap_samples * sizeof(uint64_t));
+    }
+    w->samples[w->num_samples++] = now - start;
+  }
+  return NULL;
+}
+
+static int compare_samples(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *samples, size_t n, double pct) {
+  size_t i = n * pct / 100;
+  return samples[i < n ? i : n - 1] / 1e3;
+}
+
+static void run_workload(const struct workload *workload, int num_threads) {
+  if (workload->needs_hyperfiles && !num_hyperfiles) {
+    printf("%-18s skipped, no hyperfiles under %s\n", workload->name,
+           mock_path);
+    return;
+  }
+  struct worker *workers = calloc(num_threads, sizeof(*workers));
+  pthread_t *threads = calloc(num_threads, sizeof(*threads));
+  for (int i = 0; i < num_threads; i++) {
+    workers[i] = (struct worker){
+        .workload = workload,
+        .seed = i + 1,
+        .large_fd = open(large_path, O_RDONLY),
+        .data_fd = open(data_path, O_RDWR),
+        .buf = malloc(LARGE_IO_SIZE),
+    };
+    memset(workers[i].buf, 0xa5, LARGE_IO_SIZE);
+  }
+  uint64_t start = now_ns();
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i], NULL, run_worker, &workers[i]);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  size_t n = 0;
+  unsigned long errors = 0;
+  unsigned long long bytes = 0;
+  for (int i = 0; i < num_threads; i++) {
+    n += workers[i].num_samples;
+    errors += workers[i].errors;
+    bytes += workers[i].bytes;
+  }
+  uint64_t *samples = malloc(n * sizeof(uint64_t));
+  size_t off = 0;
+  for (int i = 0; i < num_threads; i++) {
+    memcpy(&samples[off], workers[i].samples,
+           workers[i].num_samples * sizeof(uint64_t));
+    off += workers[i].num_samples;
+  }
+  qsort(samples, n, sizeof(uint64_t), compare_samples);
+
+  printf("%-18s %10.0f ops/s  p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us"
+         "  max %8.1f us",
+         workload->name, n / elapsed, percentile_us(samples, n, 50),
+         percentile_us(samples, n, 99), percentile_us(samples, n, 99.9),
+         samples[n - 1] / 1e3);
+  if (bytes) {
+    printf("  %8.1f MiB/s", bytes / elapsed / (1 << 20));
+  }
+  if (errors) {
+    printf("  %lu errors", errors);
+  }
+  putchar('\n');
+
+  free(samples);
+  for (int i = 0; i < num_threads; i++) {
+    if (workers[i].large_fd >= 0) {
+      close(workers[i].large_fd);
+    }
+    if (workers[i].data_fd >= 0) {
+      close(workers[i].data_fd);
+    }
+    free(workers[i].buf);
+    free(workers[i].samples);
+  }
+  free(threads);
+  free(workers);
+}
+
+static void remove_scratch(void) {
+  for (int i = 0; i < NUM_SCRATCH_FILES; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/f%d", scratch_path, i);
+    unlink(path);
+  }
+  unlink(data_path);
+  rmdir(scratch_path);
+}
+
+static int create_scratch(void) {
+  snprintf(scratch_path, sizeof(scratch_path), "%s/hyperfs-bench.XXXXXX",
+           mount_path);
+  if (!mkdtemp(scratch_path)) {
+    perror("error: creating scratch directory");
+    return -1;
+  }
+  for (int i = 0; i < NUM_SCRATCH_FILES; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/f%d", scratch_path, i);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  snprintf(data_path, sizeof(data_path), "%s/data", scratch_path);
+  int fd = open(data_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, DATA_FILE_SIZE)) {
+    perror("error: creating scratch data file");
+    if (fd >= 0) {
+      close(fd);
+    }
+    remove_scratch();
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-t SECONDS] [-j THREADS] [-w WORKLOAD] MOUNTPOINT\n"
+          "workloads:",
+          argv0);
+  for (size_t i = 0; i < sizeof(workloads) / sizeof(*workloads); i++) {
+    fprintf(stderr, " %s", workloads[i].name);
+  }
+  fputc('\n', stderr);
+}
+
+int main(int argc, char *argv[]) {
+  int num_threads = 1;
+  const char *only = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:j:w:")) != -1) {
+    switch (opt) {
+    case 't':
+      duration = atof(optarg);
+      break;
+    case 'j':
+      num_threads = atoi(optarg);
+      break;
+    case 'w':
+      only = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || num_threads < 1 || duration <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  mount_path = argv[optind];
+  snprintf(mock_path, sizeof(mock_path), "%s/mock", mount_path);
+  snprintf(large_path, sizeof(large_path), "%s/large", mock_path);
+
+  find_hyperfiles(mock_path);
+  if (create_scratch()) {
+    return 1;
+  }
+  printf("%zu hyperfiles, %d threads, %g s per workload\n", num_hyperfiles,
+         num_threads, duration);
+  for (size_t i = 0; i < sizeof(workloads) / sizeof(*workloads); i++) {
+    if (!only || !strcmp(only, workloads[i].name)) {
+      run_workload(&workloads[i], num_threads);
+    }
+  }
+  remove_scratch();
+  return 0;
+}
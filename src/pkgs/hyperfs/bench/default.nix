@@ -0,0 +1,27 @@
+{
+  lib,
+  runCommandCC,
+  fuse3,
+  pkg-config,
+}:
+
+# hyperfs linked against the mock host instead of libhc, and the benchmark
+# driver to run against it. Built for the build machine, not the guest.
+runCommandCC "hyperfs-bench"
+  {
+    buildInputs = [ fuse3 ];
+    nativeBuildInputs = [ pkg-config ];
+    meta.mainProgram = "hyperfs-bench";
+  }
+  ''
+    mkdir -p $out/bin
+    $CC -O2 -g \
+      ${../.}/hyperfs.c ${./.}/mock_host.c \
+      `$PKG_CONFIG fuse3 --cflags --libs` \
+      -Wall -Wextra -Werror -Wno-sign-compare -pthread \
+      -I${./.} -I${../.} -o $out/bin/hyperfs-mock
+    $CC -O2 -g \
+      ${./.}/bench.c \
+      -Wall -Wextra -Werror -Wno-sign-compare -pthread \
+      -o $out/bin/hyperfs-bench
+  ''
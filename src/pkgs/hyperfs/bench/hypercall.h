@@ -0,0 +1,34 @@
+/*
+ * HyperFS: Hypervisor-managed filesystem
+ * Copyright (C) 2024 Massachusetts Institute of Technology
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ * USA
+ */
+
+// Drop-in replacement for libhc's hypercall.h. Building hyperfs with this
+// directory ahead of libhc on the include path sends every hypercall to the
+// in-process mock host in mock_host.c instead of the hypervisor.
+
+#ifndef HYPERFS_MOCK_HYPERCALL_H
+#define HYPERFS_MOCK_HYPERCALL_H
+
+#define RETRY 0xDEADBEEF
+
+unsigned long igloo_hypercall2(unsigned long num, unsigned long arg1,
+                               unsigned long arg2);
+int hc(int hc_type, void **s, int len);
+
+#endif
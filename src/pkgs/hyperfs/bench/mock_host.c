@@ -0,0 +1,416 @@
+/*
+ * HyperFS: Hypervisor-managed filesystem
+ * Copyright (C) 2024 Massachusetts Institute of Technology
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ * USA
+ */
+
+// In-process stand-in for the host side of hyperfs, so its performance can be
+// measured on an ordinary Linux box. It serves a synthetic set of hyperfiles:
+//
+//   /mock/dN/.../dN/fI  HYPERFS_MOCK_FILES files (default 1024), spread over
+//                       HYPERFS_MOCK_DEPTH levels (default 3) of
+//                       HYPERFS_MOCK_FANOUT directories (default 8)
+//   /mock/large         one file of HYPERFS_MOCK_LARGE_SIZE bytes (64 MiB)
+//
+// The small files are HYPERFS_MOCK_FILE_SIZE bytes (default 4096). Every
+// hypercall busy-waits for HYPERFS_MOCK_LATENCY_NS (default 0) to stand in
+// for the cost of a VM exit. HYPERFS_MOCK_RING=1 accepts the submission ring,
+// and HYPERFS_MOCK_STREAM=1 marks every file streamable. Contents are a byte
+// pattern, writes are discarded and every file is always ready for poll.
+//
+// HYPERFS_MOCK_PATTERNS=1 also registers /mock/tty* and
+// /mock/net/*/statistics/* as patterns, whose files are served like f0.
+//
+// With HYPERFS_MOCK_CHURN_MS set, /mock/hotplug is added, and then removed,
+// that many milliseconds apart, starting with the first hypercall.
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hypercall.h"
+#include "protocol.h"
+
+static struct {
+  uint64_t latency_ns;
+  size_t num_files;
+  unsigned int depth;
+  unsigned int fanout;
+  off_t file_size;
+  off_t large_size;
+  int ring;
+  int stream;
+  int patterns;
+  uint64_t churn_ns, start_ns;
+} mock;
+
+static pthread_once_t mock_once = PTHREAD_ONCE_INIT;
+
+// Every path, as sent by HYP_READ_HYPERFILE_PATHS
+static char *path_blob;
+static size_t path_blob_size;
+
+static unsigned long long env_or(const char *name, unsigned long long def) {
+  const char *value = getenv(name);
+  return value && *value ? strtoull(value, NULL, 0) : def;
+}
+
+// Files are numbered from 0, with the large file last
+static void file_path(size_t i, char *buf, size_t size) {
+  if (i == mock.num_files) {
+    snprintf(buf, size, "/mock/large");
+    return;
+  }
+  int len = snprintf(buf, size, "/mock");
+  size_t dir = i;
+  for (unsigned int level = 0; level < mock.depth; level++) {
+    len += snprintf(buf + len, size - len, "/d%zu", dir % mock.fanout);
+    dir /= mock.fanout;
+  }
+  snprintf(buf + len, size - len, "/f%zu", i);
+}
+
+static void build_path_blob(void) {
+  char path[HYPERFILE_PATH_MAX];
+  for (size_t i = 0; i <= mock.num_files; i++) {
+    file_path(i, path, sizeof(path));
+    uint32_t len = strlen(path);
+    path_blob = realloc(path_blob, path_blob_size + sizeof(len) + len);
+    memcpy(&path_blob[path_blob_size], &len, sizeof(len));
+    memcpy(&path_blob[path_blob_size + sizeof(len)], path, len);
+    path_blob_size += sizeof(len) + len;
+  }
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void mock_init(void) {
+  mock.latency_ns = env_or("HYPERFS_MOCK_LATENCY_NS", 0);
+  mock.num_files = env_or("HYPERFS_MOCK_FILES", 1024);
+  mock.depth = env_or("HYPERFS_MOCK_DEPTH", 3);
+  mock.fanout = env_or("HYPERFS_MOCK_FANOUT", 8);
+  mock.file_size = env_or("HYPERFS_MOCK_FILE_SIZE", 4096);
+  mock.large_size = env_or("HYPERFS_MOCK_LARGE_SIZE", 64 << 20);
+  mock.ring = env_or("HYPERFS_MOCK_RING", 0);
+  mock.stream = env_or("HYPERFS_MOCK_STREAM", 0);
+  mock.patterns = env_or("HYPERFS_MOCK_PATTERNS", 0);
+  mock.churn_ns = env_or("HYPERFS_MOCK_CHURN_MS", 0) * 1000000;
+  mock.start_ns = now_ns();
+  if (!mock.fanout) {
+    mock.fanout = 1;
+  }
+  build_path_blob();
+}
+
+// /mock/hotplug is there in odd generations
+static uint64_t generation(void) {
+  return mock.churn_ns ? (now_ns() - mock.start_ns) / mock.churn_ns : 0;
+}
+
+static bool hotplugged(void) { return generation() % 2; }
+
+// Spin rather than sleep, since a real exit keeps the vCPU busy
+static void exit_latency(void) {
+  pthread_once(&mock_once, mock_init);
+  if (mock.latency_ns) {
+    uint64_t end = now_ns() + mock.latency_ns;
+    while (now_ns() < end) {
+    }
+  }
+}
+
+static const char *const patterns[] = {"/mock/tty*",
+                                       "/mock/net/*/statistics/*"};
+enum { NUM_PATTERNS = sizeof(patterns) / sizeof(*patterns) };
+
+// Handles are the file number plus one, since 0 means no handle
+static long file_index(const struct hyperfs_data *data) {
+  if (!data->path) {
+    return data->handle - 1;
+  }
+  if (!strcmp(data->path, "/mock/large")) {
+    return mock.num_files;
+  }
+  // Served like f0
+  if (!strcmp(data->path, "/mock/hotplug")) {
+    return hotplugged() ? 0 : -1;
+  }
+  for (size_t i = 0; mock.patterns && i < NUM_PATTERNS; i++) {
+    if (!fnmatch(patterns[i], data->path, FNM_PATHNAME | FNM_PERIOD)) {
+      return 0;
+    }
+  }
+  const char *name = strrchr(data->path, '/');
+  size_t i;
+  if (name && sscanf(name, "/f%zu", &i) == 1 && i < mock.num_files) {
+    return i;
+  }
+  return -1;
+}
+
+// Where a directory is in the tree: `levels` dN components below /mock,
+// which select the files whose number is `base` modulo `span`
+struct mock_dir {
+  unsigned int levels;
+  size_t base, span;
+};
+
+static int parse_path(const char *path, struct mock_dir *dir) {
+  *dir = (struct mock_dir){.span = 1};
+  if (!strcmp(path, "/")) {
+    return HYPERFILE_DIR;
+  }
+  if (strcmp(path, "/mock") && strncmp(path, "/mock/", 6)) {
+    return HYPERFILE_NONE;
+  }
+  for (path += strlen("/mock"); *path;) {
+    size_t n;
+    int len;
+    if (dir->levels < mock.depth && sscanf(path, "/d%zu%n", &n, &len) == 1 &&
+        (path[len] == '/' || !path[len]) && n < mock.fanout) {
+      dir->base += n * dir->span;
+      dir->span *= mock.fanout;
+      dir->levels++;
+      path += len;
+      if (dir->base >= mock.num_files) {
+        return HYPERFILE_NONE;
+      }
+    } else if (!dir->levels && !strcmp(path, "/large")) {
+      return HYPERFILE_FILE;
+    } else if (!dir->levels && !strcmp(path, "/hotplug")) {
+      return hotplugged() ? HYPERFILE_FILE : HYPERFILE_NONE;
+    } else if (dir->levels == mock.depth &&
+               sscanf(path, "/f%zu%n", &n, &len) == 1 && !path[len] &&
+               n < mock.num_files && n % dir->span == dir->base) {
+      return HYPERFILE_FILE;
+    } else {
+      return HYPERFILE_NONE;
+    }
+  }
+  return HYPERFILE_DIR;
+}
+
+static void add_entry(char *buf, size_t size, size_t *needed,
+                      const char *name, int kind) {
+  struct hyperfs_list_entry entry = {.len = strlen(name), .kind = kind};
+  if (*needed + sizeof(entry) + entry.len <= size) {
+    memcpy(&buf[*needed], &entry, sizeof(entry));
+    memcpy(&buf[*needed + sizeof(entry)], name, entry.len);
+  }
+  *needed += sizeof(entry) + entry.len;
+}
+
+static unsigned long list_dir(struct hyperfs_data *data) {
+  struct mock_dir dir;
+  if (parse_path(data->path, &dir) != HYPERFILE_DIR) {
+    return -ENOTDIR;
+  }
+  char *buf = data->list.buf;
+  size_t size = data->list.size, needed = 0;
+  char name[32];
+  if (!strcmp(data->path, "/")) {
+    add_entry(buf, size, &needed, "mock", HYPERFILE_DIR);
+    *data->list.needed = needed;
+    return 0;
+  }
+  if (!dir.levels) {
+    add_entry(buf, size, &needed, "large", HYPERFILE_FILE);
+    if (hotplugged()) {
+      add_entry(buf, size, &needed, "hotplug", HYPERFILE_FILE);
+    }
+  }
+  if (dir.levels < mock.depth) {
+    for (size_t n = 0; n < mock.fanout; n++) {
+      if (dir.base + n * dir.span < mock.num_files) {
+        snprintf(name, sizeof(name), "d%zu", n);
+        add_entry(buf, size, &needed, name, HYPERFILE_DIR);
+      }
+    }
+  } else {
+    for (size_t i = dir.base; i < mock.num_files; i += dir.span) {
+      snprintf(name, sizeof(name), "f%zu", i);
+      add_entry(buf, size, &needed, name, HYPERFILE_FILE);
+    }
+  }
+  *data->list.needed = needed;
+  return 0;
+}
+
+static unsigned long file_op(struct hyperfs_data *data) {
+  struct mock_dir dir;
+  switch (data->type) {
+  case LOOKUP:
+    *data->lookup.kind = parse_path(data->path, &dir);
+    return 0;
+  case LIST:
+    return list_dir(data);
+  }
+  long i = file_index(data);
+  if (i < 0) {
+    return -ENOENT;
+  }
+  off_t size = i == mock.num_files ? mock.large_size : mock.file_size;
+  switch (data->type) {
+  case READ: {
+    if (data->read.offset >= size) {
+      return 0;
+    }
+    size_t n = data->read.size;
+    if (n > size - data->read.offset) {
+      n = size - data->read.offset;
+    }
+    for (size_t j = 0; j < n; j++) {
+      data->read.buf[j] = (data->read.offset + j + i) & 0xff;
+    }
+    return n;
+  }
+  case WRITE:
+    return data->write.size;
+  case GETATTR:
+    *data->getattr.size = size;
+    return 0;
+  case OPEN:
+    *data->open.handle = i + 1;
+    *data->open.streamable = mock.stream;
+    return 0;
+  case POLL:
+    *data->poll.revents = data->poll.events;
+    return 0;
+  default:
+    // WINDOW is left unanswered, like on hosts without windows
+    return 0;
+  }
+}
+
+static void ring_doorbell(struct hyperfs_ring *ring) {
+  for (int i = 0; i < ring->size && i < RING_SIZE; i++) {
+    if (__atomic_load_n(&ring->entries[i].state, __ATOMIC_ACQUIRE) ==
+        RING_SUBMITTED) {
+      ring->entries[i].result = file_op(ring->entries[i].data);
+      __atomic_store_n(&ring->entries[i].state, RING_DONE, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+unsigned long igloo_hypercall2(unsigned long num, unsigned long arg1,
+                               unsigned long arg2) {
+  exit_latency();
+  if (num != MAGIC_VALUE) {
+    return -ENOSYS;
+  }
+  switch (arg1) {
+  case HYP_FILE_OP:
+    return file_op((struct hyperfs_data *)arg2);
+  case HYP_REGISTER_RING:
+    ((struct hyperfs_ring *)arg2)->enabled = mock.ring;
+    return 0;
+  case HYP_RING_DOORBELL:
+    ring_doorbell((struct hyperfs_ring *)arg2);
+    return 0;
+  default:
+    return -ENOSYS;
+  }
+}
+
+int hc(int hc_type, void **s, int len) {
+  exit_latency();
+  switch (hc_type) {
+  case HYP_GET_NUM_HYPERFILES:
+    *(size_t *)s[0] = mock.num_files + 1;
+    break;
+  case HYP_GET_HYPERFILE_PATHS:
+    for (int i = 0; i < len; i++) {
+      file_path(i, s[i], HYPERFILE_PATH_MAX);
+    }
+    break;
+  case HYP_GET_HYPERFILE_PATHS_SIZE:
+    *(size_t *)s[0] = path_blob_size;
+    break;
+  case HYP_READ_HYPERFILE_PATHS: {
+    size_t off = *(size_t *)s[1];
+    size_t size = *(size_t *)s[2];
+    if (off < path_blob_size) {
+      if (size > path_blob_size - off) {
+        size = path_blob_size - off;
+      }
+      memcpy(s[0], &path_blob[off], size);
+    }
+    break;
+  }
+  case HYP_GET_PROTOCOL_VERSION:
+    *(uint32_t *)s[0] = PROTOCOL_VERSION;
+    break;
+  case HYP_GET_INVALIDATED_PATH:
+    // Nothing is ever invalidated
+    *(char *)s[0] = '\0';
+    break;
+  case HYP_GET_HYPERFILE_CHANGES: {
+    if (!mock.churn_ns) {
+      break;
+    }
+    uint64_t *from = s[0];
+    size_t size = *(size_t *)s[2];
+    size_t *needed = s[3];
+    uint64_t current = generation();
+    *needed = 0;
+    if (*from != GENERATION_CURRENT && *from % 2 != current % 2) {
+      add_entry(s[1], size, needed, "/mock/hotplug",
+                current % 2 ? HYPERFILE_FILE : HYPERFILE_NONE);
+    }
+    if (*needed <= size) {
+      *from = current;
+    }
+    break;
+  }
+  case HYP_GET_HYPERFILE_PATTERNS: {
+    if (!mock.patterns) {
+      break;
+    }
+    size_t size = *(size_t *)s[1];
+    size_t *needed = s[2];
+    *needed = 0;
+    for (size_t i = 0; i < NUM_PATTERNS; i++) {
+      uint32_t len = strlen(patterns[i]);
+      if (*needed + sizeof(len) + len <= size) {
+        memcpy((char *)s[0] + *needed, &len, sizeof(len));
+        memcpy((char *)s[0] + *needed + sizeof(len), patterns[i], len);
+      }
+      *needed += sizeof(len) + len;
+    }
+    break;
+  }
+  case HYP_GET_HYPERFILE_SIZES:
+    for (int i = 0; i < len; i++) {
+      *(off_t *)s[i] = i == mock.num_files ? mock.large_size : mock.file_size;
+    }
+    break;
+  }
+  return 0;
+}
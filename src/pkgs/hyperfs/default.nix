@@ -18,6 +18,6 @@ runCommandCC "hyperfs"
     $CC -g \
       ${./.}/hyperfs.c \
       `$PKG_CONFIG fuse3 --cflags --libs` \
-      -Wall -Wextra -Werror -Wno-sign-compare \
+      -Wall -Wextra -Werror -Wno-sign-compare -pthread \
       -I${libhc} -o $out/bin/hyperfs
   ''
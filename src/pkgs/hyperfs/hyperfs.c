@@ -42,228 +42,2485 @@
 #define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #define FUSE_USE_VERSION 35
-#define MAGIC_VALUE 0x51ec3692 // crc32("hyperfs")
-#define PACKED __attribute__((packed))
 
 #include <dirent.h>
 #include <errno.h>
+#include <fnmatch.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/sysmacros.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "hypercall.h"
+#include "protocol.h"
 
 static size_t num_hyperfiles;
 static char **hyperfile_paths;
 
-static struct options { const char *passthrough_path; } options;
+static struct options {
+  const char *passthrough_path;
+  // Kernel entry/attribute cache timeout in seconds, 0 to disable caching
+  double cache_timeout;
+  // How often to ask the host for invalidated paths, while either the
+  // kernel or hyperfile sizes are cached
+  unsigned int invalidate_interval_ms;
+  // How long a hyperfile size from GETATTR stays valid, 0 to always ask
+  double size_cache_ttl;
+  // Hypercalls retried immediately before backing off, and the back-off cap
+  unsigned int retry_spins;
+  unsigned int retry_max_sleep_us;
+  // Let the page cache serve passthrough files instead of using direct_io
+  int page_cache;
+  // Serve hyperfiles the host backs with a window from memory, allowing mmap
+  int hyperfile_windows;
+  // Have all FUSE workers share one /dev/fuse queue
+  int no_clone_fd;
+  // How often to check whether polled hyperfiles became ready, backing off
+  // towards poll_max_interval_ms while none do
+  unsigned int poll_interval_ms;
+  unsigned int poll_max_interval_ms;
+  // Per-handle buffer size for streamable hyperfiles, 0 to disable, and how
+  // long buffered writes may wait for more before they're sent to the host
+  unsigned int stream_buffer;
+  unsigned int stream_flush_interval_ms;
+  // Ask the host about paths as they're looked up instead of loading every
+  // hyperfile path at startup, remembering up to lazy_cache_size paths that
+  // have no hyperfiles
+  int lazy_hyperfiles;
+  unsigned int lazy_cache_size;
+  // How often to ask the host for hyperfiles it added or removed, 0 to never
+  unsigned int changes_interval_ms;
+} options;
 
 #define OPTION(t, p)                                                           \
   { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
     OPTION("--passthrough-path=%s", passthrough_path),
+    OPTION("--cache-timeout=%lf", cache_timeout),
+    OPTION("--invalidate-interval=%u", invalidate_interval_ms),
+    OPTION("--size-cache-ttl=%lf", size_cache_ttl),
+    OPTION("--retry-spins=%u", retry_spins),
+    OPTION("--retry-max-sleep=%u", retry_max_sleep_us),
+    OPTION("--page-cache", page_cache),
+    OPTION("--hyperfile-windows", hyperfile_windows),
+    OPTION("--no-clone-fd", no_clone_fd),
+    OPTION("--poll-interval=%u", poll_interval_ms),
+    OPTION("--poll-max-interval=%u", poll_max_interval_ms),
+    OPTION("--stream-buffer=%u", stream_buffer),
+    OPTION("--stream-flush-interval=%u", stream_flush_interval_ms),
+    OPTION("--lazy-hyperfiles", lazy_hyperfiles),
+    OPTION("--lazy-cache-size=%u", lazy_cache_size),
+    OPTION("--changes-interval=%u", changes_interval_ms),
     FUSE_OPT_END,
 };
 
-static void trace(const char *fmt, ...) {
+// Opened once from HYPERFS_TRACE_PATH; NULL when tracing is disabled
+static FILE *trace_file;
+
+// Only evaluate the arguments when tracing is enabled
+#define trace(...)                                                             \
+  do {                                                                         \
+    if (trace_file) {                                                          \
+      trace_write(__VA_ARGS__);                                                \
+    }                                                                          \
+  } while (0)
+
+static void trace_write(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static void trace_write(const char *fmt, ...) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  va_list args;
+  va_start(args, fmt);
+
+  // Keep lines from different FUSE worker threads whole
+  flockfile(trace_file);
+  fprintf(trace_file, "[%ld.%06ld %ld] ", (long)ts.tv_sec,
+          (long)ts.tv_nsec / 1000, (long)syscall(SYS_gettid));
+  vfprintf(trace_file, fmt, args);
+  fputc('\n', trace_file);
+  funlockfile(trace_file);
+
+  va_end(args);
+}
+
+static void trace_init(void) {
   const char *path = getenv("HYPERFS_TRACE_PATH");
   if (!path) {
     return;
   }
 
-  FILE *file = fopen(path, "a");
-  if (!file) {
+  // The buffer is flushed by exit() when the filesystem is unmounted
+  trace_file = fopen(path, "a");
+  if (!trace_file) {
+    perror("error: HYPERFS_TRACE_PATH");
     return;
   }
+  setvbuf(trace_file, NULL, _IOFBF, 1 << 16);
+}
 
-  va_list args;
-  va_start(args, fmt);
+#include "passthrough.c"
+
+enum { DEV_MODE = S_IFREG | 0666, DIR_MODE = S_IFDIR | 0777 };
 
-  vfprintf(file, fmt, args);
-  fputc('\n', file);
+static size_t page_size;
 
-  va_end(args);
+// Fault in a buffer by touching one byte per page. Buffers the host will write
+// to are write-touched, so copy-on-write and zero pages are made writable too.
+static void page_in(const void *buf, size_t size, bool writable) {
+  uintptr_t addr = (uintptr_t)buf;
+  uintptr_t end = addr + size;
+  while (addr < end) {
+    volatile unsigned char *p = (volatile unsigned char *)addr;
+    if (writable) {
+      *p = *p;
+    } else {
+      (void)*p;
+    }
+    addr = (addr | (page_size - 1)) + 1;
+  }
+}
+
+static void page_in_hyperfs_data(struct hyperfs_data *data) {
+  trace("%s(%p)", __func__, data);
+
+  page_in(data, sizeof(*data), false);
+  if (data->path) {
+    page_in(data->path, strlen(data->path) + 1, false);
+  }
+  switch (data->type) {
+  case READ:
+    page_in(data->read.buf, data->read.size, true);
+    break;
+  case WRITE:
+    page_in(data->write.buf, data->write.size, false);
+    break;
+  case GETATTR:
+    page_in(data->getattr.size, sizeof(*data->getattr.size), true);
+    break;
+  case OPEN:
+    page_in(data->open.handle, sizeof(*data->open.handle), true);
+    page_in(data->open.streamable, sizeof(*data->open.streamable), true);
+    break;
+  case WINDOW:
+    page_in(data->window.size, sizeof(*data->window.size), true);
+    if (data->window.shared) {
+      page_in(data->window.shared, sizeof(*data->window.shared), true);
+    }
+    break;
+  case SYNC:
+    page_in(data->sync.buf, data->sync.size, !data->sync.to_host);
+    break;
+  case POLL:
+    page_in(data->poll.revents, sizeof(*data->poll.revents), true);
+    break;
+  case LOOKUP:
+    page_in(data->lookup.kind, sizeof(*data->lookup.kind), true);
+    break;
+  case LIST:
+    page_in(data->list.buf, data->list.size, true);
+    page_in(data->list.needed, sizeof(*data->list.needed), true);
+    break;
+  }
+}
+
+// Number of times the host asked for each op type to be retried
+static unsigned long retry_counts[NUM_FILE_OPS];
+
+// Called after the host answers RETRY for the attempt'th time. Retry right
+// away for the first few attempts, then sleep with exponential back-off so a
+// slow host-side handler doesn't keep this vCPU busy.
+static void retry_backoff(int type, unsigned int attempt) {
+  __atomic_add_fetch(&retry_counts[type], 1, __ATOMIC_RELAXED);
+  if (attempt < options.retry_spins) {
+    return;
+  }
+  unsigned int shift = attempt - options.retry_spins;
+  unsigned long us = shift < 20 ? 1ul << shift : options.retry_max_sleep_us;
+  if (us > options.retry_max_sleep_us) {
+    us = options.retry_max_sleep_us;
+  }
+  nanosleep(&(struct timespec){.tv_sec = us / 1000000,
+                               .tv_nsec = us % 1000000 * 1000},
+            NULL);
+}
+
+// Version of protocol.h the host implements, 0 on hosts from before it was
+// versioned. Those are only sent the hypercalls hyperfs started out with.
+static uint32_t host_protocol;
+
+// Submission ring registered with the host, see protocol.h
+static struct hyperfs_ring ring;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+// Whether some thread is currently ringing the doorbell for everyone
+static bool ring_busy;
+
+static void ring_init(void) {
+  trace("%s()", __func__);
+  if (!host_protocol) {
+    return;
+  }
+  ring.size = RING_SIZE;
+  mlock(&ring, sizeof(ring));
+  igloo_hypercall2(MAGIC_VALUE, HYP_REGISTER_RING, (unsigned long)&ring);
+}
+
+static int ring_state(int i) {
+  return __atomic_load_n(&ring.entries[i].state, __ATOMIC_ACQUIRE);
+}
+
+// Set by the host while hyperfs_init() registers the ring, which can race
+// with ops from workers that have already started
+static bool ring_enabled(void) {
+  return __atomic_load_n(&ring.enabled, __ATOMIC_ACQUIRE);
+}
+
+// Submit ops to the ring, as many at a time as there are free entries, and
+// wait for their results
+static void ring_file_ops(struct hyperfs_data *data, int *results, size_t n) {
+  trace("%s(%p, %zu)", __func__, data, n);
+
+  // Fault in before publishing, since another thread may ring the doorbell
+  for (size_t k = 0; k < n; k++) {
+    page_in_hyperfs_data(&data[k]);
+  }
+
+  pthread_mutex_lock(&ring_lock);
+  for (size_t next = 0; next < n;) {
+    int slots[RING_SIZE];
+    size_t num_slots = 0;
+    for (;;) {
+      for (int i = 0; i < RING_SIZE && next + num_slots < n; i++) {
+        if (ring_state(i) == RING_FREE) {
+          ring.entries[i].data = &data[next + num_slots];
+          __atomic_store_n(&ring.entries[i].state, RING_SUBMITTED,
+                           __ATOMIC_RELEASE);
+          slots[num_slots++] = i;
+        }
+      }
+      if (num_slots) {
+        break;
+      }
+      pthread_cond_wait(&ring_cond, &ring_lock);
+    }
+
+    // Either service everything submitted so far, or wait for whoever is
+    unsigned int attempt = 0;
+    for (size_t k = 0; k < num_slots;) {
+      if (ring_state(slots[k]) == RING_DONE) {
+        k++;
+        continue;
+      }
+      if (ring_busy) {
+        pthread_cond_wait(&ring_cond, &ring_lock);
+        continue;
+      }
+      ring_busy = true;
+      for (int j = 0; j < RING_SIZE; j++) {
+        if (ring_state(j) == RING_SUBMITTED) {
+          page_in_hyperfs_data(ring.entries[j].data);
+        }
+      }
+      pthread_mutex_unlock(&ring_lock);
+      if (attempt) {
+        retry_backoff(data[next].type, attempt - 1);
+      }
+      attempt++;
+      igloo_hypercall2(MAGIC_VALUE, HYP_RING_DOORBELL, (unsigned long)&ring);
+      pthread_mutex_lock(&ring_lock);
+      ring_busy = false;
+      pthread_cond_broadcast(&ring_cond);
+    }
+
+    for (size_t k = 0; k < num_slots; k++) {
+      results[next + k] = ring.entries[slots[k]].result;
+      __atomic_store_n(&ring.entries[slots[k]].state, RING_FREE,
+                       __ATOMIC_RELEASE);
+    }
+    next += num_slots;
+    pthread_cond_broadcast(&ring_cond);
+  }
+  pthread_mutex_unlock(&ring_lock);
+}
+
+static int ring_file_op(struct hyperfs_data *data) {
+  int result;
+  ring_file_ops(data, &result, 1);
+  return result;
+}
+
+static void protocol_init(void) {
+  hc(HYP_GET_PROTOCOL_VERSION, (void *[]){&host_protocol}, 1);
+  trace("%s: host protocol version %u", __func__, host_protocol);
+}
+
+static int hyp_file_op(struct hyperfs_data data) {
+  trace("%s(data)", __func__);
+  // Unversioned hosts were never taught the ops added after GETATTR
+  if (data.type > GETATTR && !host_protocol) {
+    return -ENOSYS;
+  }
+  if (ring_enabled()) {
+    return ring_file_op(&data);
+  }
+  unsigned long err;
+  for (unsigned int attempt = 0;; attempt++) {
+    page_in_hyperfs_data(&data);
+    err = igloo_hypercall2(MAGIC_VALUE, HYP_FILE_OP, (unsigned long)&data);
+    if (err != RETRY) {
+      break;
+    }
+    retry_backoff(data.type, attempt);
+  }
+  return err;
+}
+
+// Several ops at once, which the ring services in as few exits as it can
+static void hyp_file_ops(struct hyperfs_data *data, int *results, size_t n) {
+  if (ring_enabled()) {
+    ring_file_ops(data, results, n);
+    return;
+  }
+  for (size_t k = 0; k < n; k++) {
+    results[k] = hyp_file_op(data[k]);
+  }
+}
+
+// Index of every hyperfile and every directory implied by one, keyed by path.
+// Open addressing with linear probing. Directory keys point into the path of
+// the hyperfile that implied them, so they are not NUL-terminated.
+struct hyperfile_node {
+  const char *path;
+  size_t len;
+  uint32_t hash;
+  bool is_file;
+  // Name within the parent directory, and the entries directly beneath a
+  // directory
+  char *name;
+  struct hyperfile_node **children;
+  size_t num_children;
+  // Position of this entry in its parent's children
+  size_t child_index;
+  // Cached hyperfile size, valid until the CLOCK_MONOTONIC time size_expiry
+  off_t size;
+  uint64_t size_expiry;
+  // Memory shared with the host holding the hyperfile's contents, if the
+  // host backs it with a window. Protected by window_lock.
+  pthread_mutex_t window_lock;
+  char *window;
+  size_t window_size;
+  bool window_checked, window_dirty;
+  // Set for /.hyperfs/stats, which is served here rather than by the host
+  bool is_stats;
+  // With --lazy-hyperfiles, set once the host has listed a directory, after
+  // which children missing from the index don't exist
+  bool listed;
+  // Set once the literal names patterns have beneath a directory are indexed
+  bool patterns_listed;
+  // Set when the host removes the hyperfile (or the last one beneath a
+  // directory). The node stays in the table, and is reused if the path is
+  // added again.
+  bool removed;
+  // Set for paths only the host's patterns match, whose nodes aren't in the
+  // table and are freed along with the open file or directory holding them
+  bool detached;
+};
+
+// Nodes are never freed, so a node stays valid after index_lock is dropped.
+// The lock guards the table and every node's children.
+static struct hyperfile_node **hyperfile_index;
+static size_t hyperfile_index_cap, hyperfile_index_len;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// FNV-1a
+static uint32_t hash_path(const char *path, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static struct hyperfile_node **index_slot(struct hyperfile_node **table,
+                                          size_t cap, const char *path,
+                                          size_t len, uint32_t hash) {
+  size_t mask = cap - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    struct hyperfile_node *node = table[i];
+    if (!node || (node->hash == hash && node->len == len &&
+                  !memcmp(node->path, path, len))) {
+      return &table[i];
+    }
+  }
+}
+
+// Called with index_lock held
+static struct hyperfile_node *index_get(const char *path, size_t len) {
+  if (!hyperfile_index_cap) {
+    return NULL;
+  }
+  struct hyperfile_node *node = *index_slot(
+      hyperfile_index, hyperfile_index_cap, path, len, hash_path(path, len));
+  return node && !node->removed ? node : NULL;
+}
+
+static struct hyperfile_node *index_find(const char *path, size_t len) {
+  pthread_rwlock_rdlock(&index_lock);
+  struct hyperfile_node *node = index_get(path, len);
+  pthread_rwlock_unlock(&index_lock);
+  return node;
+}
+
+static void index_resize(size_t cap) {
+  struct hyperfile_node **table = calloc(cap, sizeof(*table));
+  for (size_t i = 0; i < hyperfile_index_cap; i++) {
+    struct hyperfile_node *node = hyperfile_index[i];
+    if (node) {
+      *index_slot(table, cap, node->path, node->len, node->hash) = node;
+    }
+  }
+  free(hyperfile_index);
+  hyperfile_index = table;
+  hyperfile_index_cap = cap;
+}
+
+// The rest of the index functions are called with index_lock held for writing
+
+// Returns the node for a path, adding it if it's missing or was removed, in
+// which case *added is set. *took_path is set if the new node points into
+// path, which must then outlive the index.
+static struct hyperfile_node *index_insert(const char *path, size_t len,
+                                           bool *added, bool *took_path) {
+  // Keep the load factor at or below 1/2 so probe sequences stay short
+  if ((hyperfile_index_len + 1) * 2 > hyperfile_index_cap) {
+    index_resize(hyperfile_index_cap ? hyperfile_index_cap * 2 : 64);
+  }
+  uint32_t hash = hash_path(path, len);
+  struct hyperfile_node **slot =
+      index_slot(hyperfile_index, hyperfile_index_cap, path, len, hash);
+  *added = false;
+  if (!*slot) {
+    *slot = calloc(1, sizeof(**slot));
+    **slot = (struct hyperfile_node){
+        .path = path,
+        .len = len,
+        .hash = hash,
+        .window_lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+    hyperfile_index_len++;
+    *added = true;
+    if (took_path) {
+      *took_path = true;
+    }
+  } else if ((*slot)->removed) {
+    // Removed directories were empty, so only the flags need resetting
+    (*slot)->removed = false;
+    (*slot)->is_file = false;
+    (*slot)->listed = false;
+    (*slot)->patterns_listed = false;
+    (*slot)->size_expiry = 0;
+    *added = true;
+  }
+  return *slot;
+}
+
+static struct hyperfile_node *index_parent(const char *path, size_t len) {
+  size_t parent_len = len - 1;
+  while (parent_len && path[parent_len] != '/') {
+    parent_len--;
+  }
+  return index_get(path, parent_len ? parent_len : 1);
+}
+
+// Insert an entry, and if it was added, add it to its parent's children
+static struct hyperfile_node *index_insert_child(const char *path, size_t len,
+                                                 bool *took_path) {
+  bool added;
+  struct hyperfile_node *node = index_insert(path, len, &added, took_path);
+  if (!added) {
+    return node;
+  }
+  struct hyperfile_node *parent = index_parent(path, len);
+  if (!node->name) {
+    // The root's path is "/", and every other name follows a '/'
+    size_t start = parent->len == 1 ? 1 : parent->len + 1;
+    node->name = strndup(&path[start], len - start);
+  }
+  // Grow the array whenever its length reaches a power of two
+  size_t n = parent->num_children;
+  if (!(n & (n - 1))) {
+    parent->children =
+        realloc(parent->children, (n ? n * 2 : 1) * sizeof(*parent->children));
+  }
+  node->child_index = parent->num_children;
+  parent->children[parent->num_children++] = node;
+  return node;
+}
+
+// Insert a path and the directories it implies. *took_path (if given) is set
+// when a new node points into the path, which must then outlive the index.
+static struct hyperfile_node *index_path(const char *path, bool is_file,
+                                         bool *took_path) {
+  size_t len = strlen(path);
+  // The root and every proper prefix ending at a '/' is an implied directory
+  bool added;
+  index_insert("/", 1, &added, took_path);
+  for (size_t i = 1; i < len; i++) {
+    if (path[i] == '/') {
+      index_insert_child(path, i, took_path);
+    }
+  }
+  struct hyperfile_node *node = index_insert_child(path, len, took_path);
+  if (is_file) {
+    node->is_file = true;
+  }
+  return node;
+}
+
+// Remove a hyperfile, then any directories left empty. With
+// --lazy-hyperfiles, a directory that hasn't been listed may have hyperfiles
+// the index hasn't seen. It's kept if its parent has been listed, since the
+// host wouldn't be asked about it again.
+static void index_remove(const char *path, size_t len) {
+  struct hyperfile_node *node = index_get(path, len);
+  if (!node || !node->is_file || node->is_stats) {
+    return;
+  }
+  while (node->len > 1 && !node->num_children) {
+    struct hyperfile_node *parent = index_parent(node->path, node->len);
+    if (options.lazy_hyperfiles && !node->is_file && !node->listed &&
+        parent->listed) {
+      break;
+    }
+    // Move the last child into the removed one's place
+    struct hyperfile_node *last = parent->children[--parent->num_children];
+    parent->children[node->child_index] = last;
+    last->child_index = node->child_index;
+    node->removed = true;
+    node = parent;
+  }
+}
+
+// The index needs absolute paths with a parent, so the host's paths are
+// checked before they're added
+static bool valid_hyperfile_path(const char *path, size_t len) {
+  return len >= 2 && path[0] == '/' && path[len - 1] != '/';
+}
+
+static void index_hyperfile(const char *hf_path) {
+  pthread_rwlock_wrlock(&index_lock);
+  index_path(hf_path, true, NULL);
+  pthread_rwlock_unlock(&index_lock);
+}
+
+// With --lazy-hyperfiles, paths missing from the index are resolved with
+// LOOKUP one component at a time from the root, so the host's answer for a
+// directory covers everything beneath it. Directories are filled in with
+// LIST when they're first read. Paths without hyperfiles are most of what
+// gets looked up, so they're remembered in a bounded cache. Hits only take a
+// read lock and mark the entry referenced. Once the cache is full, a clock
+// hand sweeping over the entries evicts the first one not referenced since
+// the hand last passed it, which approximates LRU.
+struct absent_path {
+  char *path;
+  size_t len;
+  uint32_t hash;
+  struct absent_path *hash_next;
+  // Position in absent_ring
+  size_t ring_index;
+  bool referenced;
+};
+
+static struct absent_path **absent_table;
+static size_t absent_buckets;
+static struct absent_path **absent_ring;
+static size_t num_absent, absent_hand;
+static pthread_rwlock_t absent_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Called with absent_lock held
+static struct absent_path **absent_slot(const char *path, size_t len,
+                                        uint32_t hash) {
+  struct absent_path **ap = &absent_table[hash & (absent_buckets - 1)];
+  while (*ap && !((*ap)->hash == hash && (*ap)->len == len &&
+                  !memcmp((*ap)->path, path, len))) {
+    ap = &(*ap)->hash_next;
+  }
+  return ap;
+}
+
+static bool is_absent(const char *path, size_t len) {
+  if (!absent_buckets) {
+    return false;
+  }
+  uint32_t hash = hash_path(path, len);
+  pthread_rwlock_rdlock(&absent_lock);
+  struct absent_path *a = *absent_slot(path, len, hash);
+  // Checked first so hits on a hot entry don't keep writing to it
+  if (a && !__atomic_load_n(&a->referenced, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&a->referenced, true, __ATOMIC_RELAXED);
+  }
+  pthread_rwlock_unlock(&absent_lock);
+  return a;
+}
+
+// Called with absent_lock held for writing
+static void drop_absent(struct absent_path **ap) {
+  struct absent_path *a = *ap;
+  *ap = a->hash_next;
+  struct absent_path *last = absent_ring[--num_absent];
+  absent_ring[a->ring_index] = last;
+  last->ring_index = a->ring_index;
+  if (absent_hand >= num_absent) {
+    absent_hand = 0;
+  }
+  free(a->path);
+  free(a);
+}
+
+// Called with absent_lock held for writing, with the cache full
+static void evict_absent(void) {
+  while (absent_ring[absent_hand]->referenced) {
+    absent_ring[absent_hand]->referenced = false;
+    absent_hand = (absent_hand + 1) % num_absent;
+  }
+  struct absent_path *old = absent_ring[absent_hand];
+  drop_absent(absent_slot(old->path, old->len, old->hash));
+}
+
+static void add_absent(const char *path, size_t len) {
+  if (!absent_buckets) {
+    return;
+  }
+  uint32_t hash = hash_path(path, len);
+  pthread_rwlock_wrlock(&absent_lock);
+  struct absent_path **ap = absent_slot(path, len, hash);
+  if (!*ap) {
+    if (num_absent == options.lazy_cache_size) {
+      evict_absent();
+      // Removing the old entry may have moved the new one's slot
+      ap = absent_slot(path, len, hash);
+    }
+    struct absent_path *a = malloc(sizeof(*a));
+    *a = (struct absent_path){
+        .path = strndup(path, len),
+        .len = len,
+        .hash = hash,
+        .ring_index = num_absent,
+    };
+    *ap = a;
+    absent_ring[num_absent++] = a;
+  }
+  pthread_rwlock_unlock(&absent_lock);
+}
+
+// Forget that a hyperfile's path and the directories above it had none
+static void forget_absent(const char *path, size_t len) {
+  if (!absent_buckets) {
+    return;
+  }
+  pthread_rwlock_wrlock(&absent_lock);
+  for (size_t i = 1; i <= len; i++) {
+    if (i == len || path[i] == '/') {
+      struct absent_path **ap = absent_slot(path, i, hash_path(path, i));
+      if (*ap) {
+        drop_absent(ap);
+      }
+    }
+  }
+  pthread_rwlock_unlock(&absent_lock);
+}
+
+// Returns -1 on hosts without LOOKUP
+static int lookup_hyperfile(const char *path) {
+  int kind = -1;
+  hyp_file_op((struct hyperfs_data){
+      .type = LOOKUP,
+      .path = path,
+      .lookup.kind = &kind,
+  });
+  return kind;
+}
+
+static struct hyperfile_node *resolve_lazily(const char *path) {
+  trace("%s(%s)", __func__, path);
+  size_t len = strlen(path);
+  struct hyperfile_node *parent = NULL;
+  for (size_t i = 1; i <= len; i++) {
+    if (i < len && path[i] != '/') {
+      continue;
+    }
+    struct hyperfile_node *node = index_find(path, i);
+    if (!node) {
+      if ((parent && __atomic_load_n(&parent->listed, __ATOMIC_ACQUIRE)) ||
+          is_absent(path, i)) {
+        return NULL;
+      }
+      char *prefix = strndup(path, i);
+      int kind = lookup_hyperfile(prefix);
+      if (kind != HYPERFILE_FILE && kind != HYPERFILE_DIR) {
+        add_absent(path, i);
+        free(prefix);
+        return NULL;
+      }
+      bool took_path = false;
+      pthread_rwlock_wrlock(&index_lock);
+      node = index_get(prefix, i);
+      if (!node) {
+        node = index_path(prefix, kind == HYPERFILE_FILE, &took_path);
+      }
+      pthread_rwlock_unlock(&index_lock);
+      if (!took_path) {
+        free(prefix);
+      }
+    }
+    if (i == len) {
+      return node;
+    }
+    if (node->is_file) {
+      return NULL;
+    }
+    parent = node;
+  }
+  return NULL;
+}
+
+static void list_lazily(struct hyperfile_node *dir) {
+  if (__atomic_load_n(&dir->listed, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  // Directories implied by a path point into it, so aren't NUL-terminated
+  char *path = strndup(dir->path, dir->len);
+  trace("%s(%s)", __func__, path);
+  size_t size = 4096, needed;
+  char *buf = NULL;
+  for (;;) {
+    buf = realloc(buf, size);
+    needed = 0;
+    int ret = hyp_file_op((struct hyperfs_data){
+        .type = LIST,
+        .path = path,
+        .list.buf = buf,
+        .list.size = size,
+        .list.needed = &needed,
+    });
+    if (ret < 0) {
+      free(buf);
+      free(path);
+      return;
+    }
+    if (needed <= size) {
+      break;
+    }
+    size = needed;
+  }
+
+  size_t prefix_len = dir->len == 1 ? 0 : dir->len;
+  pthread_rwlock_wrlock(&index_lock);
+  for (size_t off = 0; needed - off >= sizeof(struct hyperfs_list_entry);) {
+    struct hyperfs_list_entry entry;
+    memcpy(&entry, &buf[off], sizeof(entry));
+    off += sizeof(entry);
+    if (entry.len > needed - off) {
+      break;
+    }
+    const char *name = &buf[off];
+    off += entry.len;
+    if (!entry.len || memchr(name, '/', entry.len)) {
+      continue;
+    }
+    char *child = malloc(prefix_len + entry.len + 2);
+    memcpy(child, path, prefix_len);
+    child[prefix_len] = '/';
+    memcpy(&child[prefix_len + 1], name, entry.len);
+    child[prefix_len + entry.len + 1] = '\0';
+    bool took_path = false;
+    if (!index_get(child, prefix_len + entry.len + 1)) {
+      index_path(child, entry.kind == HYPERFILE_FILE, &took_path);
+    }
+    if (!took_path) {
+      free(child);
+    }
+  }
+  __atomic_store_n(&dir->listed, true, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&index_lock);
+  free(buf);
+  free(path);
+}
+
+// Returns false on hosts without LOOKUP
+static bool lazy_init(void) {
+  if (lookup_hyperfile("/") < 0) {
+    return false;
+  }
+  if (options.lazy_cache_size) {
+    absent_buckets = 1;
+    while (absent_buckets < options.lazy_cache_size) {
+      absent_buckets *= 2;
+    }
+    absent_table = calloc(absent_buckets, sizeof(*absent_table));
+    absent_ring = calloc(options.lazy_cache_size, sizeof(*absent_ring));
+  }
+  return true;
+}
+
+// Patterns the host registers so a family of hyperfiles (e.g. /dev/ttyS*)
+// doesn't have to be listed path by path. They're compiled into a trie of
+// path components, and a path is matched one component at a time against
+// every edge that could match, so the cost depends on the path's length
+// rather than the number of paths the patterns cover. Literal components
+// are found by binary search, prefixes like "ttyS*" by comparing the prefix,
+// and other wildcards with fnmatch(). Every proper prefix of a match is a
+// directory. Matches aren't indexed, see lookup_node().
+struct pattern_edge {
+  char *component;
+  // Length of a prefix component before its '*', otherwise -1
+  ssize_t prefix_len;
+  struct pattern_state *next;
+};
+
+struct pattern_state {
+  // Literals are sorted by component
+  struct pattern_edge *literals, *globs;
+  size_t num_literals, num_globs;
+  // Set if a pattern ends here
+  bool match;
+};
+
+// Built before FUSE starts and never changed after
+static struct pattern_state *pattern_root;
+static size_t num_patterns;
+// Most states a path can lead to at once. The trie is a tree, so they're all
+// at the same depth, and each pattern adds at most one state at each depth.
+static size_t pattern_width;
+// Per-thread room for pattern_states() when it doesn't fit on the stack
+static pthread_key_t pattern_buffer_key;
+
+static struct pattern_state *add_pattern_edge(struct pattern_edge **edges,
+                                              size_t *n, const char *comp,
+                                              bool literal) {
+  for (size_t i = 0; i < *n; i++) {
+    if (!strcmp((*edges)[i].component, comp)) {
+      return (*edges)[i].next;
+    }
+  }
+  size_t len = strlen(comp);
+  // A lone "*" goes to fnmatch(), which won't match a leading '.'
+  ssize_t prefix_len = -1;
+  if (!literal && len > 1 && comp[len - 1] == '*' &&
+      strcspn(comp, "*?[\\") == len - 1) {
+    prefix_len = len - 1;
+  }
+  *edges = realloc(*edges, (*n + 1) * sizeof(**edges));
+  (*edges)[*n] = (struct pattern_edge){
+      .component = strdup(comp),
+      .prefix_len = prefix_len,
+      .next = calloc(1, sizeof(struct pattern_state)),
+  };
+  return (*edges)[(*n)++].next;
+}
+
+static void add_pattern(char *pattern) {
+  // /.hyperfs is served here
+  if (pattern[0] != '/' ||
+      (!strncmp(pattern, "/.hyperfs", 9) &&
+       (!pattern[9] || pattern[9] == '/'))) {
+    return;
+  }
+  struct pattern_state *state = pattern_root;
+  char *save;
+  for (char *comp = strtok_r(pattern, "/", &save); comp;
+       comp = strtok_r(NULL, "/", &save)) {
+    if (strpbrk(comp, "*?[\\")) {
+      state = add_pattern_edge(&state->globs, &state->num_globs, comp, false);
+    } else {
+      state = add_pattern_edge(&state->literals, &state->num_literals, comp,
+                               true);
+    }
+  }
+  if (state != pattern_root) {
+    state->match = true;
+    num_patterns++;
+  }
+}
+
+static int compare_edges(const void *a, const void *b) {
+  return strcmp(((const struct pattern_edge *)a)->component,
+                ((const struct pattern_edge *)b)->component);
+}
+
+static void sort_pattern_edges(struct pattern_state *state) {
+  if (state->num_literals) {
+    qsort(state->literals, state->num_literals, sizeof(*state->literals),
+          compare_edges);
+  }
+  for (size_t i = 0; i < state->num_literals; i++) {
+    sort_pattern_edges(state->literals[i].next);
+  }
+  for (size_t i = 0; i < state->num_globs; i++) {
+    sort_pattern_edges(state->globs[i].next);
+  }
+}
+
+static void load_hyperfile_patterns(void) {
+  trace("%s()", __func__);
+  if (!host_protocol) {
+    return;
+  }
+  size_t size = 4096, needed;
+  char *buf = NULL;
+  for (;;) {
+    buf = realloc(buf, size);
+    page_in(buf, size, true);
+    needed = 0;
+    hc(HYP_GET_HYPERFILE_PATTERNS, (void *[]){buf, &size, &needed}, 3);
+    if (needed <= size) {
+      break;
+    }
+    size = needed;
+  }
+  if (needed) {
+    pattern_root = calloc(1, sizeof(*pattern_root));
+  }
+  for (size_t off = 0; needed - off >= sizeof(uint32_t);) {
+    uint32_t len;
+    memcpy(&len, &buf[off], sizeof(len));
+    off += sizeof(len);
+    if (len > needed - off) {
+      break;
+    }
+    char *pattern = strndup(&buf[off], len);
+    off += len;
+    trace("%s: %s", __func__, pattern);
+    add_pattern(pattern);
+    free(pattern);
+  }
+  if (pattern_root) {
+    sort_pattern_edges(pattern_root);
+    pattern_width = num_patterns ? num_patterns : 1;
+    pthread_key_create(&pattern_buffer_key, free);
+  }
+  free(buf);
+}
+
+static bool pattern_edge_matches(const struct pattern_edge *edge,
+                                 const char *comp) {
+  if (edge->prefix_len >= 0) {
+    return !strncmp(edge->component, comp, edge->prefix_len);
+  }
+  return !fnmatch(edge->component, comp, FNM_PERIOD);
+}
+
+// Find the states a path leads to. states has room for 2 * pattern_width, and
+// the result is at the start.
+static size_t pattern_states(const char *path, struct pattern_state **states) {
+  struct pattern_state **cur = states, **next = &states[pattern_width];
+  size_t n = 1;
+  cur[0] = pattern_root;
+  char comp[NAME_MAX + 1];
+  for (const char *p = path; *p && n;) {
+    while (*p == '/') {
+      p++;
+    }
+    size_t len = strcspn(p, "/");
+    if (!len) {
+      break;
+    }
+    if (len > NAME_MAX) {
+      return 0;
+    }
+    memcpy(comp, p, len);
+    comp[len] = '\0';
+    p += len;
+    // The trie is a tree, so no state is reached twice
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+      struct pattern_edge key = {.component = comp};
+      struct pattern_edge *edge =
+          cur[i]->num_literals
+              ? bsearch(&key, cur[i]->literals, cur[i]->num_literals,
+                        sizeof(key), compare_edges)
+              : NULL;
+      if (edge) {
+        next[m++] = edge->next;
+      }
+      for (size_t j = 0; j < cur[i]->num_globs; j++) {
+        if (pattern_edge_matches(&cur[i]->globs[j], comp)) {
+          next[m++] = cur[i]->globs[j].next;
+        }
+      }
+    }
+    struct pattern_state **tmp = cur;
+    cur = next;
+    next = tmp;
+    n = m;
+  }
+  if (cur != states) {
+    memcpy(states, cur, n * sizeof(*states));
+  }
+  return n;
+}
+
+static struct pattern_state **get_pattern_buffer(void) {
+  struct pattern_state **buf = pthread_getspecific(pattern_buffer_key);
+  if (!buf) {
+    buf = malloc(pattern_width * 2 * sizeof(*buf));
+    if (buf && pthread_setspecific(pattern_buffer_key, buf)) {
+      free(buf);
+      return NULL;
+    }
+  }
+  return buf;
+}
+
+// Returns HYPERFILE_FILE if a pattern matches a path, HYPERFILE_DIR if one
+// matches something beneath it, or else HYPERFILE_NONE. fn, if given, is
+// called with each literal name the patterns have directly beneath the path,
+// and whether that's a hyperfile.
+static int match_patterns(const char *path,
+                          void (*fn)(const char *name, bool is_file,
+                                     void *arg),
+                          void *arg) {
+  struct pattern_state *local[64];
+  struct pattern_state **states =
+      pattern_width * 2 <= 64 ? local : get_pattern_buffer();
+  if (!states) {
+    return HYPERFILE_NONE;
+  }
+  size_t n = pattern_states(path, states);
+  int kind = HYPERFILE_NONE;
+  for (size_t i = 0; i < n; i++) {
+    if (states[i]->match) {
+      kind = HYPERFILE_FILE;
+    } else if (kind == HYPERFILE_NONE &&
+               (states[i]->num_literals || states[i]->num_globs)) {
+      kind = HYPERFILE_DIR;
+    }
+    for (size_t j = 0; fn && j < states[i]->num_literals; j++) {
+      struct pattern_edge *edge = &states[i]->literals[j];
+      fn(edge->component, edge->next->match, arg);
+    }
+  }
+  return kind;
+}
+
+// Called with index_lock held for writing
+static void index_pattern_child(const char *name, bool is_file, void *arg) {
+  struct hyperfile_node *dir = arg;
+  size_t prefix_len = dir->len == 1 ? 0 : dir->len;
+  size_t len = prefix_len + 1 + strlen(name);
+  char *child = malloc(len + 1);
+  memcpy(child, dir->path, prefix_len);
+  child[prefix_len] = '/';
+  strcpy(&child[prefix_len + 1], name);
+  bool took_path = false;
+  if (!index_get(child, len)) {
+    index_path(child, is_file, &took_path);
+  }
+  if (!took_path) {
+    free(child);
+  }
+}
+
+// Add the literal names the patterns have in a directory, so it lists them
+static void list_patterns(struct hyperfile_node *dir) {
+  if (__atomic_load_n(&dir->patterns_listed, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  char *path = strndup(dir->path, dir->len);
+  pthread_rwlock_wrlock(&index_lock);
+  match_patterns(path, index_pattern_child, dir);
+  __atomic_store_n(&dir->patterns_listed, true, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&index_lock);
+  free(path);
+}
+
+// Paths the patterns match aren't indexed, or every name ever looked up under
+// a glob would stay in its directory's listing, and the index would grow
+// without bound. *match is filled in for them instead, pointing to path.
+static struct hyperfile_node *lookup_node(const char *path,
+                                          struct hyperfile_node *match) {
+  size_t len = strlen(path);
+  struct hyperfile_node *node = index_find(path, len);
+  if (node) {
+    return node;
+  }
+  if (pattern_root) {
+    int kind = match_patterns(path, NULL, NULL);
+    if (kind != HYPERFILE_NONE) {
+      *match = (struct hyperfile_node){
+          .path = path,
+          .len = len,
+          .is_file = kind == HYPERFILE_FILE,
+          .window_lock = PTHREAD_MUTEX_INITIALIZER,
+          .detached = true,
+      };
+      return match;
+    }
+  }
+  return options.lazy_hyperfiles ? resolve_lazily(path) : NULL;
+}
+
+// Copy a node from lookup_node()'s *match, for an open file or directory to
+// hold on to
+static struct hyperfile_node *detach_node(const struct hyperfile_node *match,
+                                          const char *name) {
+  struct hyperfile_node *node = malloc(sizeof(*node));
+  *node = (struct hyperfile_node){
+      .path = strndup(match->path, match->len),
+      .len = match->len,
+      .is_file = match->is_file,
+      .name = name ? strdup(name) : NULL,
+      .window_lock = PTHREAD_MUTEX_INITIALIZER,
+      .detached = true,
+  };
+  return node;
+}
+
+static void free_detached(struct hyperfile_node *node) {
+  free((char *)node->path);
+  free(node->name);
+  free(node);
+}
+
+static int lookup_mode(const char *path) {
+  trace("%s(%s)", __func__, path);
+  struct hyperfile_node match;
+  struct hyperfile_node *node = lookup_node(path, &match);
+  if (!node) {
+    return -1;
+  }
+  return node->is_file ? DEV_MODE : DIR_MODE;
+}
+
+static bool exists(const char *path) { return lookup_mode(path) >= 0; }
+
+static pthread_mutex_t size_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void cache_size(struct hyperfile_node *node, off_t size, uint64_t now) {
+  pthread_mutex_lock(&size_cache_lock);
+  node->size = size;
+  node->size_expiry = now + options.size_cache_ttl * 1e9;
+  pthread_mutex_unlock(&size_cache_lock);
+}
+
+// Drop a cached size after an operation that may have changed it
+static void forget_size(struct hyperfile_node *node) {
+  pthread_mutex_lock(&size_cache_lock);
+  node->size_expiry = 0;
+  pthread_mutex_unlock(&size_cache_lock);
+}
+
+static bool cached_size(struct hyperfile_node *node, uint64_t now,
+                        off_t *size) {
+  pthread_mutex_lock(&size_cache_lock);
+  bool hit = now < node->size_expiry;
+  if (hit) {
+    *size = node->size;
+  }
+  pthread_mutex_unlock(&size_cache_lock);
+  return hit;
+}
+
+static off_t hyperfile_size(struct hyperfile_node *node) {
+  trace("%s(%s)", __func__, node->path);
+  uint64_t now = 0;
+  off_t size = 0;
+  if (options.size_cache_ttl > 0) {
+    now = now_ns();
+    if (cached_size(node, now, &size)) {
+      return size;
+    }
+  }
+  hyp_file_op((struct hyperfs_data){
+      .type = GETATTR,
+      .path = node->path,
+      .getattr.size = &size,
+  });
+  if (now) {
+    cache_size(node, size, now);
+  }
+  return size;
+}
+
+// Sizes of several hyperfiles, asking the host for the uncached ones all at
+// once
+static void hyperfile_sizes(struct hyperfile_node **nodes, size_t n,
+                            off_t *sizes) {
+  trace("%s(%zu)", __func__, n);
+  uint64_t now = options.size_cache_ttl > 0 ? now_ns() : 0;
+  struct hyperfs_data *ops = malloc(n * sizeof(*ops));
+  size_t *which = malloc(n * sizeof(*which));
+  size_t num_ops = 0;
+  for (size_t i = 0; i < n; i++) {
+    sizes[i] = 0;
+    if (!now || !cached_size(nodes[i], now, &sizes[i])) {
+      ops[num_ops] = (struct hyperfs_data){
+          .type = GETATTR,
+          .path = nodes[i]->path,
+          .getattr.size = &sizes[i],
+      };
+      which[num_ops++] = i;
+    }
+  }
+  int *results = malloc(num_ops * sizeof(*results));
+  hyp_file_ops(ops, results, num_ops);
+  for (size_t k = 0; now && k < num_ops; k++) {
+    cache_size(nodes[which[k]], sizes[which[k]], now);
+  }
+  free(results);
+  free(which);
+  free(ops);
+}
+
+// Fill in the attributes of a hyperfile or hyperfile directory, except for
+// the size of a hyperfile without a window, in which case this returns true
+static bool hyperfile_stat(struct hyperfile_node *node, struct stat *st) {
+  if (node->is_stats) {
+    // Sized 0 like procfs files; reads aren't limited by it with direct_io
+    st->st_mode = S_IFREG | 0444;
+  } else if (node->is_file) {
+    st->st_mode = DEV_MODE;
+    st->st_size = __atomic_load_n(&node->window_size, __ATOMIC_ACQUIRE);
+    return !st->st_size;
+  } else {
+    st->st_mode = DIR_MODE;
+  }
+  return false;
+}
+
+// Per-open state of a hyperfile, kept in fi->fh. Ops on an open file go by
+// this rather than the path, which may have been added or removed as a
+// hyperfile since. Passthrough files keep their descriptor in fi->fh, which
+// never has HYPERFILE_FH set.
+static const uint64_t HYPERFILE_FH = 1ull << 63;
+
+struct open_hyperfile {
+  struct hyperfile_node *node;
+  // Handle the host returned from OPEN, or 0
+  unsigned long handle;
+  struct stream *stream;
+  struct stats_snapshot *stats;
+};
+
+static struct open_hyperfile *open_hyperfile(struct fuse_file_info *fi) {
+  if (!fi || !(fi->fh & HYPERFILE_FH)) {
+    return NULL;
+  }
+  return (struct open_hyperfile *)(uintptr_t)(fi->fh & ~HYPERFILE_FH);
+}
+
+// The hyperfile a file was opened as, or NULL for a passthrough file
+static struct hyperfile_node *open_node(struct fuse_file_info *fi) {
+  struct open_hyperfile *of = open_hyperfile(fi);
+  return of ? of->node : NULL;
+}
+
+static unsigned long host_handle(struct fuse_file_info *fi) {
+  struct open_hyperfile *of = open_hyperfile(fi);
+  return of ? of->handle : 0;
+}
+
+static struct stream *file_stream(struct fuse_file_info *fi) {
+  struct open_hyperfile *of = open_hyperfile(fi);
+  return of ? of->stream : NULL;
+}
+
+// Always-on counters for the ops that matter most to guest performance,
+// split by whether they went to the host. Each op's latency is counted in a
+// power-of-two bucket of nanoseconds, so recording one is a single atomic
+// add. Read them from /.hyperfs/stats, or send SIGUSR1 to dump them to the
+// trace (stderr when tracing is disabled).
+enum {
+  STATS_GETATTR,
+  STATS_READ,
+  STATS_WRITE,
+  STATS_IOCTL,
+  STATS_READDIR,
+  NUM_STATS_OPS,
+};
+
+enum { NUM_LATENCY_BUCKETS = 48 };
+
+static const char STATS_PATH[] = "/.hyperfs/stats";
+
+static const char *const stats_op_names[NUM_STATS_OPS] = {
+    "getattr", "read", "write", "ioctl", "readdir",
+};
+
+static const char *const file_op_names[NUM_FILE_OPS] = {
+    "read", "write", "ioctl", "getattr", "open",
+    "release", "window", "sync", "poll", "lookup", "list",
+};
+
+// Indexed by [hyperfile][op][floor(log2(ns))]
+static unsigned long latency_buckets[2][NUM_STATS_OPS][NUM_LATENCY_BUCKETS];
+
+static void count_op(int op, bool hyperfile, uint64_t start) {
+  uint64_t ns = now_ns() - start;
+  int bucket = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+  if (bucket >= NUM_LATENCY_BUCKETS) {
+    bucket = NUM_LATENCY_BUCKETS - 1;
+  }
+  __atomic_add_fetch(&latency_buckets[hyperfile][op][bucket], 1,
+                     __ATOMIC_RELAXED);
+}
+
+// Upper bound, in ns, of the bucket the pct'th percentile falls in
+static unsigned long long latency_percentile(const unsigned long *buckets,
+                                             unsigned long long count,
+                                             unsigned int pct) {
+  unsigned long long seen = 0;
+  for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen && seen * 100 >= count * pct) {
+      return 2ull << i;
+    }
+  }
+  return 0;
+}
+
+static void write_stats(FILE *f) {
+  fputs("# op kind count p50_ns p90_ns p99_ns log2_ns:count...\n", f);
+  for (int hyperfile = 0; hyperfile < 2; hyperfile++) {
+    for (int op = 0; op < NUM_STATS_OPS; op++) {
+      unsigned long buckets[NUM_LATENCY_BUCKETS];
+      unsigned long long count = 0;
+      for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+        buckets[i] = __atomic_load_n(&latency_buckets[hyperfile][op][i],
+                                     __ATOMIC_RELAXED);
+        count += buckets[i];
+      }
+      fprintf(f, "%s %s %llu %llu %llu %llu", stats_op_names[op],
+              hyperfile ? "hyperfile" : "passthrough", count,
+              latency_percentile(buckets, count, 50),
+              latency_percentile(buckets, count, 90),
+              latency_percentile(buckets, count, 99));
+      for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+        if (buckets[i]) {
+          fprintf(f, " %d:%lu", i, buckets[i]);
+        }
+      }
+      fputc('\n', f);
+    }
+  }
+  fputs("retries", f);
+  for (int type = 0; type < NUM_FILE_OPS; type++) {
+    fprintf(f, " %s=%lu", file_op_names[type],
+            __atomic_load_n(&retry_counts[type], __ATOMIC_RELAXED));
+  }
+  fputc('\n', f);
+}
+
+// Each open of the stats file gets its own snapshot, so reading it in
+// several chunks gives consistent numbers
+struct stats_snapshot {
+  char *buf;
+  size_t size;
+};
+
+static int open_stats(struct fuse_file_info *fi, struct open_hyperfile *of) {
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    return -EACCES;
+  }
+  struct stats_snapshot *snap = calloc(1, sizeof(*snap));
+  FILE *f = snap ? open_memstream(&snap->buf, &snap->size) : NULL;
+  if (!f) {
+    free(snap);
+    return -ENOMEM;
+  }
+  write_stats(f);
+  if (fclose(f)) {
+    free(snap->buf);
+    free(snap);
+    return -ENOMEM;
+  }
+  of->stats = snap;
+  fi->direct_io = 1;
+  return 0;
+}
+
+static int read_stats(struct open_hyperfile *of, char *buf, size_t size,
+                      off_t offset) {
+  struct stats_snapshot *snap = of->stats;
+  if (offset >= snap->size) {
+    return 0;
+  }
+  if (size > snap->size - offset) {
+    size = snap->size - offset;
+  }
+  memcpy(buf, &snap->buf[offset], size);
+  return size;
+}
+
+static void release_stats(struct open_hyperfile *of) {
+  struct stats_snapshot *snap = of->stats;
+  free(snap->buf);
+  free(snap);
+}
+
+// SIGUSR1 is blocked in every other thread, so the dump doesn't have to be
+// async-signal-safe. It also flushes whatever trace lines are buffered.
+static void *signal_thread(void *arg) {
+  (void)arg;
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  int sig;
+  while (!sigwait(&set, &sig)) {
+    FILE *f = trace_file ? trace_file : stderr;
+    flockfile(f);
+    write_stats(f);
+    fflush(f);
+    funlockfile(f);
+  }
+  return NULL;
+}
+
+// Identify the hyperfile an op is for, by its handle if the host gave one
+static struct hyperfs_data hyperfile_target(int type, const char *path,
+                                            unsigned long handle) {
+  return (struct hyperfs_data){
+      .type = type,
+      .path = handle ? NULL : path,
+      .handle = handle,
+  };
+}
+
+// With --stream-buffer, hyperfiles the host marks streamable at OPEN get a
+// buffer per handle. Reads fill it from the host a whole buffer at a time,
+// and sequential writes collect in it until it fills up, they've waited
+// --stream-flush-interval, or there's an fsync, ioctl or release. Errors
+// from writes sent late are reported by the next fsync. Only hosts that
+// give handles get streams, so flushing one doesn't need the path.
+struct stream {
+  pthread_mutex_t lock;
+  unsigned long handle;
+  char *buf;
+  // Offset of buf[0] in the file, and how much of buf holds data
+  off_t off;
+  size_t len;
+  // Whether the data is writes the host hasn't seen yet, and since when
+  bool dirty;
+  uint64_t dirty_since;
+  // First error from a late write, returned by the next fsync
+  int error;
+  struct stream *next;
+};
+
+static struct stream *streams;
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stream_thread_once = PTHREAD_ONCE_INIT;
+
+// Called with the stream locked
+static void flush_stream(struct stream *s) {
+  if (!s->dirty) {
+    return;
+  }
+  trace("%s(%lu, off=%ld, len=%zu)", __func__, s->handle, (long)s->off,
+        s->len);
+  struct hyperfs_data data = hyperfile_target(WRITE, NULL, s->handle);
+  data.write.buf = s->buf;
+  data.write.size = s->len;
+  data.write.offset = s->off;
+  int ret = hyp_file_op(data);
+  if (ret >= 0 && ret < s->len) {
+    ret = -EIO;
+  }
+  if (ret < 0 && !s->error) {
+    s->error = ret;
+  }
+  s->dirty = false;
+  s->len = 0;
+}
+
+static void *stream_thread(void *arg) {
+  (void)arg;
+  for (;;) {
+    usleep(options.stream_flush_interval_ms * 1000);
+    uint64_t now = now_ns();
+    pthread_mutex_lock(&streams_lock);
+    for (struct stream *s = streams; s; s = s->next) {
+      pthread_mutex_lock(&s->lock);
+      if (s->dirty && now - s->dirty_since >=
+                          options.stream_flush_interval_ms * 1000000ull) {
+        flush_stream(s);
+      }
+      pthread_mutex_unlock(&s->lock);
+    }
+    pthread_mutex_unlock(&streams_lock);
+  }
+  return NULL;
+}
+
+static void start_stream_thread(void) {
+  pthread_t thread;
+  if (!pthread_create(&thread, NULL, stream_thread, NULL)) {
+    pthread_detach(thread);
+  }
+}
+
+static struct stream *open_stream(unsigned long handle) {
+  struct stream *s = calloc(1, sizeof(*s));
+  char *buf = malloc(options.stream_buffer);
+  if (!s || !buf) {
+    free(s);
+    free(buf);
+    return NULL;
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  s->handle = handle;
+  s->buf = buf;
+  pthread_once(&stream_thread_once, start_stream_thread);
+  pthread_mutex_lock(&streams_lock);
+  s->next = streams;
+  streams = s;
+  pthread_mutex_unlock(&streams_lock);
+  return s;
+}
+
+// Send any buffered writes and drop readahead, e.g. before an ioctl whose
+// effect on the file's contents isn't known. Returns any pending error.
+static int sync_stream(struct stream *s) {
+  pthread_mutex_lock(&s->lock);
+  flush_stream(s);
+  s->len = 0;
+  int ret = s->error;
+  s->error = 0;
+  pthread_mutex_unlock(&s->lock);
+  return ret;
+}
+
+static int close_stream(struct stream *s) {
+  pthread_mutex_lock(&streams_lock);
+  struct stream **sp = &streams;
+  while (*sp != s) {
+    sp = &(*sp)->next;
+  }
+  *sp = s->next;
+  pthread_mutex_unlock(&streams_lock);
+  int ret = sync_stream(s);
+  pthread_mutex_destroy(&s->lock);
+  free(s->buf);
+  free(s);
+  return ret;
+}
+
+static int read_stream(struct stream *s, char *buf, size_t size,
+                       off_t offset) {
+  pthread_mutex_lock(&s->lock);
+  flush_stream(s);
+  size_t done = 0;
+  bool refilled = false;
+  int ret = 0;
+  while (done < size) {
+    if (offset >= s->off && offset < s->off + (off_t)s->len) {
+      size_t n = s->off + s->len - offset;
+      if (n > size - done) {
+        n = size - done;
+      }
+      memcpy(buf + done, &s->buf[offset - s->off], n);
+      done += n;
+      offset += n;
+      continue;
+    }
+    // Stop at the end of the file, or whatever else made the host return
+    // less than a full buffer
+    if (refilled) {
+      break;
+    }
+    refilled = true;
+    // Reads at least as big as the buffer wouldn't gain anything from it
+    bool direct = size - done >= options.stream_buffer;
+    struct hyperfs_data data = hyperfile_target(READ, NULL, s->handle);
+    data.read.buf = direct ? buf + done : s->buf;
+    data.read.size = direct ? size - done : options.stream_buffer;
+    data.read.offset = offset;
+    ret = hyp_file_op(data);
+    if (ret <= 0) {
+      break;
+    }
+    if (direct) {
+      done += ret;
+      break;
+    }
+    s->off = offset;
+    s->len = ret;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return done || ret >= 0 ? (int)done : ret;
+}
+
+static int write_stream(struct stream *s, const char *buf, size_t size,
+                        off_t offset) {
+  pthread_mutex_lock(&s->lock);
+  // Readahead may be stale once the file's written to
+  if (!s->dirty) {
+    s->len = 0;
+  }
+  if (s->dirty && (offset != s->off + (off_t)s->len ||
+                   s->len + size > options.stream_buffer)) {
+    flush_stream(s);
+  }
+  int ret = size;
+  if (size >= options.stream_buffer) {
+    struct hyperfs_data data = hyperfile_target(WRITE, NULL, s->handle);
+    data.write.buf = buf;
+    data.write.size = size;
+    data.write.offset = offset;
+    ret = hyp_file_op(data);
+  } else {
+    if (!s->dirty) {
+      s->off = offset;
+      s->dirty = true;
+      s->dirty_since = now_ns();
+    }
+    memcpy(&s->buf[s->len], buf, size);
+    s->len += size;
+    if (s->len == options.stream_buffer) {
+      flush_stream(s);
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+  return ret;
+}
+
+// With --hyperfile-windows, the host can back a hyperfile with a fixed-size
+// window. The first open registers locked memory for it with the host, like
+// the ring, which the host then reads and writes directly. Reads and writes
+// are served from there without hypercalls, and the host is told about
+// writes with SYNC on fsync (including msync), ioctl and release. Windows
+// live as long as their index node, so paths only matched by patterns,
+// whose nodes are freed, go without.
+
+static int sync_window(struct hyperfile_node *node, const char *path,
+                       struct fuse_file_info *fi) {
+  trace("%s(%s)", __func__, path);
+  struct hyperfs_data data = hyperfile_target(SYNC, path, host_handle(fi));
+  data.sync.buf = node->window;
+  data.sync.size = node->window_size;
+  data.sync.to_host = true;
+  return hyp_file_op(data);
+}
+
+// Returns whether the hyperfile is backed by a window
+static bool open_window(struct hyperfile_node *node, const char *path,
+                        struct fuse_file_info *fi) {
+  if (!options.hyperfile_windows || node->detached) {
+    return false;
+  }
+  pthread_mutex_lock(&node->window_lock);
+  if (!node->window_checked) {
+    node->window_checked = true;
+    size_t size = 0;
+    struct hyperfs_data data = hyperfile_target(WINDOW, path, host_handle(fi));
+    data.window.size = &size;
+    hyp_file_op(data);
+    char *window = size ? mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                        : MAP_FAILED;
+    int shared = 0;
+    if (window != MAP_FAILED && !mlock(window, size)) {
+      data.window.buf = window;
+      data.window.shared = &shared;
+      hyp_file_op(data);
+    }
+    if (shared) {
+      node->window = window;
+      // Read without the lock by hyperfs_getattr()
+      __atomic_store_n(&node->window_size, size, __ATOMIC_RELEASE);
+    } else if (window != MAP_FAILED) {
+      munmap(window, size);
+    }
+  }
+  bool ret = node->window;
+  pthread_mutex_unlock(&node->window_lock);
+  return ret;
+}
+
+static int flush_window(struct hyperfile_node *node, const char *path,
+                        struct fuse_file_info *fi) {
+  int ret = 0;
+  pthread_mutex_lock(&node->window_lock);
+  if (node->window_dirty) {
+    ret = sync_window(node, path, fi);
+    node->window_dirty = false;
+  }
+  pthread_mutex_unlock(&node->window_lock);
+  return ret;
+}
+
+// Copy between a window and buf. Returns false if there's no window.
+static bool access_window(struct hyperfile_node *node, char *buf, size_t size,
+                          off_t offset, bool write, int *ret) {
+  pthread_mutex_lock(&node->window_lock);
+  bool windowed = node->window;
+  if (windowed && offset >= node->window_size) {
+    *ret = write ? -ENOSPC : 0;
+  } else if (windowed) {
+    if (size > node->window_size - offset) {
+      size = node->window_size - offset;
+    }
+    if (write) {
+      memcpy(&node->window[offset], buf, size);
+      node->window_dirty = true;
+    } else {
+      memcpy(buf, &node->window[offset], size);
+    }
+    *ret = size;
+  }
+  pthread_mutex_unlock(&node->window_lock);
+  return windowed;
+}
+
+// What the kernel reports for files without a poll handler
+enum { DEFAULT_POLLMASK = POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM };
+
+// Poll handles for files that weren't ready yet. A background thread waits
+// in poll() on the passthrough files' backing descriptors, checks on the
+// hyperfiles every --poll-interval milliseconds, backing off while none
+// become ready, and wakes up the kernel's waiters once they are.
+struct pending_poll {
+  struct pending_poll *next;
+  // fi->fh of the open file, and a number that changes with every new ph
+  uint64_t fh;
+  uint64_t id;
+  // Backing descriptor of a passthrough file, or -1 for a hyperfile
+  int fd;
+  char *path;
+  unsigned long handle;
+  unsigned int events;
+  struct fuse_pollhandle *ph;
+};
+
+static struct pending_poll *pending_polls;
+static size_t num_pending_polls;
+static uint64_t next_poll_id;
+static bool poll_added;
+static pthread_mutex_t poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t poll_thread_once = PTHREAD_ONCE_INIT;
+// Written to wake the poll thread for a new pending poll. Without it, the
+// thread never waits longer than the poll interval.
+static int poll_wake_fd = -1;
+
+// Hosts without POLL leave revents alone, and their hyperfiles are treated as
+// always ready, like before hyperfs had a poll handler
+static unsigned int poll_hyperfile(const char *path, unsigned long handle,
+                                   unsigned int events) {
+  unsigned int revents = UINT_MAX;
+  struct hyperfs_data data = hyperfile_target(POLL, path, handle);
+  data.poll.events = events;
+  data.poll.revents = &revents;
+  hyp_file_op(data);
+  return revents == UINT_MAX ? DEFAULT_POLLMASK : revents;
+}
+
+static unsigned int poll_fd(int fd, unsigned int events) {
+  struct pollfd pfd = {.fd = fd, .events = events};
+  return poll(&pfd, 1, 0) == 1 ? (unsigned short)pfd.revents : 0;
+}
+
+// A pending poll as of when the poll thread last looked, so the checks can
+// be made without holding poll_lock
+struct poll_check {
+  uint64_t id;
+  int fd;
+  char *path;
+  unsigned long handle;
+  unsigned int events;
+  bool ready;
+};
+
+static struct poll_check *snapshot_polls(size_t *n) {
+  *n = 0;
+  for (struct pending_poll *p = pending_polls; p; p = p->next) {
+    (*n)++;
+  }
+  struct poll_check *checks = malloc(*n * sizeof(*checks));
+  size_t i = 0;
+  for (struct pending_poll *p = pending_polls; p; p = p->next, i++) {
+    checks[i] = (struct poll_check){
+        .id = p->id,
+        .fd = p->fd,
+        .path = strdup(p->path),
+        .handle = p->handle,
+        .events = p->events,
+    };
+  }
+  return checks;
+}
+
+// Wake up the waiters of the polls found ready, unless they were dropped or
+// polled again meanwhile
+static void notify_ready_polls(struct poll_check *checks, size_t n) {
+  for (struct pending_poll **pp = &pending_polls; *pp;) {
+    struct pending_poll *p = *pp;
+    size_t i = 0;
+    while (i < n && checks[i].id != p->id) {
+      i++;
+    }
+    if (i < n && checks[i].ready) {
+      fuse_notify_poll(p->ph);
+      fuse_pollhandle_destroy(p->ph);
+      *pp = p->next;
+      free(p->path);
+      free(p);
+      __atomic_sub_fetch(&num_pending_polls, 1, __ATOMIC_RELAXED);
+    } else {
+      pp = &p->next;
+    }
+  }
+}
+
+// Ask the host about the pending hyperfile polls. Hosts that count readiness
+// changes only need asking about each hyperfile once the count moves. The
+// count is read first, so a change made while the hyperfiles are being asked
+// about isn't missed.
+static bool check_hyperfile_polls(struct poll_check *checks, size_t n,
+                                  uint64_t *generation) {
+  uint64_t current = GENERATION_CURRENT;
+  if (host_protocol) {
+    hc(HYP_GET_POLL_GENERATION, (void *[]){&current}, 1);
+  }
+  bool ask_host = current == GENERATION_CURRENT || current != *generation;
+  *generation = current;
+  bool any_ready = false;
+  for (size_t i = 0; ask_host && i < n; i++) {
+    struct poll_check *c = &checks[i];
+    if (c->fd < 0) {
+      c->ready = poll_hyperfile(c->path, c->handle, c->events) & c->events;
+      any_ready |= c->ready;
+    }
+  }
+  return any_ready;
+}
+
+static void *poll_thread(void *arg) {
+  (void)arg;
+  unsigned int interval_ms = options.poll_interval_ms;
+  uint64_t generation = GENERATION_CURRENT;
+  for (;;) {
+    pthread_mutex_lock(&poll_lock);
+    bool added = poll_added;
+    poll_added = false;
+    size_t n;
+    struct poll_check *checks = snapshot_polls(&n);
+    pthread_mutex_unlock(&poll_lock);
+
+    // The wakeup descriptor goes first, then the passthrough files'
+    struct pollfd *pfds = malloc((n + 1) * sizeof(*pfds));
+    pfds[0] = (struct pollfd){.fd = poll_wake_fd, .events = POLLIN};
+    size_t num_pfds = 1;
+    bool hyperfiles = false;
+    for (size_t i = 0; i < n; i++) {
+      if (checks[i].fd >= 0) {
+        pfds[num_pfds++] = (struct pollfd){
+            .fd = checks[i].fd,
+            .events = checks[i].events,
+        };
+      } else {
+        hyperfiles = true;
+      }
+    }
+
+    // The host is only asked when a hyperfile poll is pending, and the
+    // thread only wakes on a timer for those
+    if (added) {
+      interval_ms = options.poll_interval_ms;
+    }
+    bool any_ready =
+        hyperfiles && check_hyperfile_polls(checks, n, &generation);
+    int timeout = -1;
+    if (any_ready) {
+      timeout = 0;
+    } else if (hyperfiles || poll_wake_fd < 0) {
+      timeout = interval_ms;
+    }
+    int ret = poll(pfds, num_pfds, timeout);
+    if (ret > 0) {
+      for (size_t i = 0, k = 1; i < n; i++) {
+        if (checks[i].fd >= 0) {
+          // Errors and hangups are reported whether or not they were asked
+          // for, and the waiter has to see them too
+          checks[i].ready = pfds[k++].revents &
+                            (checks[i].events | POLLERR | POLLHUP | POLLNVAL);
+          any_ready |= checks[i].ready;
+        }
+      }
+      if (pfds[0].revents & POLLIN) {
+        eventfd_t count;
+        eventfd_read(poll_wake_fd, &count);
+      }
+    }
+    free(pfds);
+
+    // Back off while no hyperfile becomes ready
+    if (any_ready) {
+      interval_ms = options.poll_interval_ms;
+    } else if (!ret && interval_ms < options.poll_max_interval_ms) {
+      interval_ms = interval_ms * 2 < options.poll_max_interval_ms
+                        ? interval_ms * 2
+                        : options.poll_max_interval_ms;
+    }
+
+    pthread_mutex_lock(&poll_lock);
+    notify_ready_polls(checks, n);
+    pthread_mutex_unlock(&poll_lock);
+    for (size_t i = 0; i < n; i++) {
+      free(checks[i].path);
+    }
+    free(checks);
+  }
+  return NULL;
+}
+
+static void start_poll_thread(void) {
+  poll_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  pthread_t thread;
+  if (!pthread_create(&thread, NULL, poll_thread, NULL)) {
+    pthread_detach(thread);
+  }
+}
+
+static void add_pending_poll(struct fuse_file_info *fi, int fd,
+                             const char *path, unsigned long handle,
+                             unsigned int events, struct fuse_pollhandle *ph) {
+  pthread_once(&poll_thread_once, start_poll_thread);
+  pthread_mutex_lock(&poll_lock);
+  // The kernel asks again with a new handle on every poll, which supersedes
+  // the previous one for the same open file
+  struct pending_poll *p;
+  for (p = pending_polls; p; p = p->next) {
+    if (p->fh == fi->fh) {
+      fuse_pollhandle_destroy(p->ph);
+      break;
+    }
+  }
+  if (!p) {
+    p = calloc(1, sizeof(*p));
+    p->fh = fi->fh;
+    p->fd = fd;
+    p->path = strdup(path);
+    p->handle = handle;
+    p->next = pending_polls;
+    pending_polls = p;
+    __atomic_add_fetch(&num_pending_polls, 1, __ATOMIC_RELAXED);
+  }
+  p->id = ++next_poll_id;
+  p->events = events;
+  p->ph = ph;
+  poll_added = true;
+  pthread_mutex_unlock(&poll_lock);
+  if (poll_wake_fd >= 0) {
+    eventfd_write(poll_wake_fd, 1);
+  }
+}
+
+// Called on release. The kernel doesn't poll a file while releasing it, so
+// if nothing is pending there's nothing to drop for it.
+static void drop_pending_polls(struct fuse_file_info *fi) {
+  if (!__atomic_load_n(&num_pending_polls, __ATOMIC_RELAXED)) {
+    return;
+  }
+  pthread_mutex_lock(&poll_lock);
+  for (struct pending_poll **pp = &pending_polls; *pp;) {
+    struct pending_poll *p = *pp;
+    if (p->fh == fi->fh) {
+      fuse_pollhandle_destroy(p->ph);
+      *pp = p->next;
+      free(p->path);
+      free(p);
+      __atomic_sub_fetch(&num_pending_polls, 1, __ATOMIC_RELAXED);
+    } else {
+      pp = &p->next;
+    }
+  }
+  pthread_mutex_unlock(&poll_lock);
+}
+
+// Whether the kernel lets files opened with direct_io be mmapped
+static bool direct_io_mmap;
+
+static void free_open_hyperfile(struct open_hyperfile *of) {
+  if (of->node->detached) {
+    free_detached(of->node);
+  }
+  free(of);
+}
+
+static int hyperfs_open(const char *path, struct fuse_file_info *fi) {
+  trace("%s(%s, %p)", __func__, path, fi);
+  struct hyperfile_node match;
+  struct hyperfile_node *node = lookup_node(path, &match);
+  if (!node) {
+    fi->direct_io = !options.page_cache;
+    return xmp_open(path, fi);
+  }
+  struct open_hyperfile *of = calloc(1, sizeof(*of));
+  if (!of) {
+    return -ENOMEM;
+  }
+  if (node == &match) {
+    node = detach_node(&match, NULL);
+  }
+  of->node = node;
+  if (node->is_stats) {
+    int ret = open_stats(fi, of);
+    if (ret < 0) {
+      free_open_hyperfile(of);
+    } else {
+      fi->fh = (uintptr_t)of | HYPERFILE_FH;
+    }
+    return ret;
+  }
+  // Hyperfile contents can change with every read, so never cache them
+  fi->direct_io = 1;
+  fi->keep_cache = 0;
+  // Hosts without per-open state leave the handle at 0, so later ops fall
+  // back to sending the path
+  int streamable = 0;
+  if (node->is_file) {
+    int ret = hyp_file_op((struct hyperfs_data){
+        .type = OPEN,
+        .path = path,
+        .open.flags = fi->flags,
+        .open.handle = &of->handle,
+        .open.streamable = &streamable,
+    });
+    if (ret < 0 && ret != -ENOSYS) {
+      free_open_hyperfile(of);
+      return ret;
+    }
+  }
+  fi->fh = (uintptr_t)of | HYPERFILE_FH;
+  // Windows are plain memory, so mmap can work on them. Kernels that allow
+  // mmap with direct_io still send reads and writes here, so they see the
+  // host's changes rather than what the page cache had.
+  if (node->is_file && open_window(node, path, fi)) {
+    fi->direct_io = direct_io_mmap;
+  } else if (streamable && of->handle && options.stream_buffer) {
+    of->stream = open_stream(of->handle);
+  }
+  return 0;
+}
+
+// Return whether a path is /proc/self or /proc/PID
+static bool is_proc_pid_path(const char *path)
+{
+  int pid, len;
+  bool is_proc_self = !strcmp(path, "/proc/self");
+  bool is_proc_pid = sscanf(path, "/proc/%d%n", &pid, &len) == 1 && len == strlen(path);
+  return is_proc_self || is_proc_pid;
+}
+
+static int hyperfs_getattr(const char *path, struct stat *st,
+                           struct fuse_file_info *fi) {
+  trace("%s(%s, st=%p, fi=%p)", __func__, path, st, fi);
+  uint64_t start = now_ns();
+
+  memset(st, 0, sizeof(struct stat));
+  st->st_nlink = !strcmp(path, "/") ? 2 : 1;
+
+  struct hyperfile_node match;
+  struct hyperfile_node *node = open_node(fi);
+  if (!node) {
+    node = lookup_node(path, &match);
+  }
+
+  int ret = 0;
+  if (node) {
+    if (hyperfile_stat(node, st)) {
+      st->st_size = hyperfile_size(node);
+    }
+  } else if (is_proc_pid_path(path)) {
+    st->st_mode = S_IFLNK | 0777;
+  } else {
+    ret = xmp_getattr(path, st, fi);
+  }
+  count_op(STATS_GETATTR, node != NULL, start);
+  return ret;
+}
+
+struct readdir_ctx {
+  void *buf;
+  fuse_fill_dir_t filler;
+  bool plus;
+  // Directory path (empty for the root), followed by the current entry name
+  char path[PATH_MAX];
+  size_t prefix_len;
+  // The directory's hyperfile children when the listing started, which of
+  // them the passthrough tree has, and their attributes for readdirplus
+  struct hyperfile_node **children;
+  bool *emitted;
+  struct stat *child_st;
+  size_t num_children;
+  // Whether the directory is only matched by patterns, so its children are
+  // detached nodes owned by the snapshot
+  bool detached;
+  // A hyperfile directory's offsets count entries, since the children
+  // listed after the passthrough entries can't be given telldir() offsets.
+  // tells[i] is the telldir() offset after the passthrough entry at offset
+  // i + 1, and pos is the offset of the last entry returned.
+  bool counted;
+  off_t *tells;
+  size_t num_tells;
+  off_t pos;
+};
+
+// Per-open state of a hyperfile directory, kept in fi->fh like an open
+// hyperfile's. It's listed as the passthrough directory's entries, then the
+// hyperfile children that aren't among them.
+struct open_dir {
+  struct hyperfile_node *node;
+  // Passthrough directory handle from xmp_opendir(), or 0 if there's none
+  uint64_t fh;
+  struct readdir_ctx ctx;
+  // Whether ctx holds a snapshot of the children, which may be empty
+  bool read;
+  // Whether the passthrough entries have all been seen, after which the
+  // indexes of the remaining children in ctx.children are in tail
+  bool passthrough_done;
+  size_t *tail;
+  size_t num_tail;
+};
 
-  fclose(file);
+static struct open_dir *open_dir(struct fuse_file_info *fi) {
+  if (!fi || !(fi->fh & HYPERFILE_FH)) {
+    return NULL;
+  }
+  return (struct open_dir *)(uintptr_t)(fi->fh & ~HYPERFILE_FH);
 }
 
-#include "passthrough.c"
+static void free_children(struct readdir_ctx *ctx) {
+  for (size_t i = 0; ctx->detached && i < ctx->num_children; i++) {
+    free_detached(ctx->children[i]);
+  }
+  free(ctx->child_st);
+  free(ctx->emitted);
+  free(ctx->children);
+  ctx->child_st = NULL;
+  ctx->emitted = NULL;
+  ctx->children = NULL;
+  ctx->num_children = 0;
+}
 
-enum { HYP_FILE_OP, HYP_GET_NUM_HYPERFILES, HYP_GET_HYPERFILE_PATHS };
+// A child of a detached directory, whose path is in ctx->path
+static struct hyperfile_node *find_child(struct readdir_ctx *ctx,
+                                         const char *name) {
+  for (size_t i = 0; i < ctx->num_children; i++) {
+    if (!strcmp(ctx->children[i]->name, name)) {
+      return ctx->children[i];
+    }
+  }
+  return NULL;
+}
 
-enum { READ, WRITE, IOCTL, GETATTR };
+// Called by match_patterns() for each literal name in a detached directory
+static void add_detached_child(const char *name, bool is_file, void *arg) {
+  struct readdir_ctx *ctx = arg;
+  int len = snprintf(&ctx->path[ctx->prefix_len], PATH_MAX - ctx->prefix_len,
+                     "/%s", name);
+  if (len <= 0 || ctx->prefix_len + len >= PATH_MAX || find_child(ctx, name)) {
+    return;
+  }
+  struct hyperfile_node match = {
+      .path = ctx->path,
+      .len = ctx->prefix_len + len,
+      .is_file = is_file,
+  };
+  struct hyperfile_node *child = detach_node(&match, name);
+  // Grow the array whenever its length reaches a power of two
+  size_t n = ctx->num_children;
+  if (!(n & (n - 1))) {
+    ctx->children =
+        realloc(ctx->children, (n ? n * 2 : 1) * sizeof(*ctx->children));
+  }
+  child->child_index = n;
+  ctx->children[ctx->num_children++] = child;
+}
 
-enum { DEV_MODE = S_IFREG | 0666, DIR_MODE = S_IFDIR | 0777 };
+// Snapshot a hyperfile directory's children
+static void read_children(struct hyperfile_node *dir,
+                          struct readdir_ctx *ctx) {
+  free_children(ctx);
+  if (dir->detached) {
+    // The patterns are all there is to list
+    ctx->detached = true;
+    match_patterns(dir->path, add_detached_child, ctx);
+    ctx->emitted = calloc(ctx->num_children, sizeof(bool));
+    return;
+  }
 
-enum { HYPERFILE_PATH_MAX = 1024 };
+  if (options.lazy_hyperfiles) {
+    list_lazily(dir);
+  }
+  if (pattern_root) {
+    list_patterns(dir);
+  }
 
-struct hyperfs_data {
-  int type;
-  const char *path;
-  union {
-    struct {
-      char *buf;
-      size_t size;
-      off_t offset;
-    } PACKED read;
-    struct {
-      const char *buf;
-      size_t size;
-      off_t offset;
-    } PACKED write;
-    struct {
-      unsigned int cmd;
-      void *data;
-    } PACKED ioctl;
-    struct {
-      off_t *size;
-    } PACKED getattr;
-  } PACKED;
-} PACKED;
+  // Nodes are never freed, so only the array needs copying
+  pthread_rwlock_rdlock(&index_lock);
+  size_t n = dir->num_children;
+  ctx->children = malloc(n * sizeof(*ctx->children));
+  if (n) {
+    memcpy(ctx->children, dir->children, n * sizeof(*ctx->children));
+  }
+  pthread_rwlock_unlock(&index_lock);
+  ctx->num_children = n;
+  ctx->emitted = calloc(n, sizeof(bool));
+}
 
-static void page_in_hyperfs_data(struct hyperfs_data *data) {
-  trace("%s(%p)", __func__, data);
+// Attributes of the snapshotted children for readdirplus, fetching the
+// sizes the host has to be asked for together
+static void stat_children(struct readdir_ctx *ctx) {
+  size_t n = ctx->num_children;
+  ctx->child_st = calloc(n, sizeof(*ctx->child_st));
+  struct hyperfile_node **unsized = malloc(n * sizeof(*unsized));
+  size_t *which = malloc(n * sizeof(*which));
+  size_t num_unsized = 0;
+  for (size_t i = 0; i < n; i++) {
+    ctx->child_st[i].st_nlink = 1;
+    if (hyperfile_stat(ctx->children[i], &ctx->child_st[i])) {
+      unsized[num_unsized] = ctx->children[i];
+      which[num_unsized++] = i;
+    }
+  }
+  off_t *sizes = malloc(num_unsized * sizeof(*sizes));
+  hyperfile_sizes(unsized, num_unsized, sizes);
+  for (size_t k = 0; k < num_unsized; k++) {
+    ctx->child_st[which[k]].st_size = sizes[k];
+  }
+  free(sizes);
+  free(which);
+  free(unsized);
+}
 
-  volatile unsigned char x = 0;
-  size_t i;
-  for (i = 0; i < sizeof(*data); i++) {
-    x += ((unsigned char *)data)[i];
+// Pass an entry on, numbering it if the directory's offsets are counted
+static int fill_entry(struct readdir_ctx *ctx, const char *name,
+                      const struct stat *st, off_t off,
+                      enum fuse_fill_dir_flags flags) {
+  if (!ctx->counted) {
+    return ctx->filler(ctx->buf, name, st, off, flags);
   }
-  for (i = 0; data->path[i]; i++) {
-    x += data->path[i];
+  if (ctx->filler(ctx->buf, name, st, ctx->pos + 1, flags)) {
+    return 1;
   }
-  switch (data->type) {
-  case READ:
-    for (i = 0; i < data->read.size; i++) {
-      x += data->read.buf[i];
-    }
-    break;
-  case WRITE:
-    for (i = 0; i < data->write.size; i++) {
-      x += data->write.buf[i];
+  // Grow the array whenever its length reaches a power of two
+  size_t n = ctx->num_tells;
+  if (ctx->pos == n) {
+    if (!(n & (n - 1))) {
+      ctx->tells = realloc(ctx->tells, (n ? n * 2 : 1) * sizeof(*ctx->tells));
     }
-    break;
+    ctx->num_tells++;
   }
+  ctx->tells[ctx->pos++] = off;
+  return 0;
 }
 
-static int hyp_file_op(struct hyperfs_data data) {
-  trace("%s(data)", __func__);
-  unsigned long err = RETRY;
-  do {
-    page_in_hyperfs_data(&data);
-    err = igloo_hypercall2(MAGIC_VALUE, HYP_FILE_OP, (unsigned long)&data);
-  } while (err == RETRY);
-  return err;
+static int readdir_filler(void *buf, const char *name, const struct stat *st,
+                          off_t off, enum fuse_fill_dir_flags flags) {
+  struct readdir_ctx *ctx = buf;
+  int len = snprintf(&ctx->path[ctx->prefix_len], PATH_MAX - ctx->prefix_len,
+                     "/%s", name);
+  if (len <= 0 || ctx->prefix_len + len >= PATH_MAX) {
+    flags &= ~FUSE_FILL_DIR_PLUS;
+    return fill_entry(ctx, name, st, off, flags);
+  }
+  struct hyperfile_node *node =
+      ctx->detached ? find_child(ctx, name)
+                    : index_find(ctx->path, ctx->prefix_len + len);
+  // Children added or moved since the listing started aren't tracked
+  if (node && node->child_index < ctx->num_children &&
+      ctx->children[node->child_index] == node) {
+    ctx->emitted[node->child_index] = true;
+    if (ctx->plus) {
+      st = &ctx->child_st[node->child_index];
+      flags |= FUSE_FILL_DIR_PLUS;
+    }
+  } else if ((flags & FUSE_FILL_DIR_PLUS) &&
+             (node || is_proc_pid_path(ctx->path) ||
+              (pattern_root &&
+               match_patterns(ctx->path, NULL, NULL) != HYPERFILE_NONE))) {
+    // getattr wouldn't give the passthrough file's attributes
+    flags &= ~FUSE_FILL_DIR_PLUS;
+  }
+  return fill_entry(ctx, name, st, off, flags);
 }
 
-static int lookup_mode(const char *path) {
-  trace("%s(%s)", __func__, path);
-  int mode = -1;
-  for (size_t i = 0; i < num_hyperfiles; i++) {
-    const char *hf_path = hyperfile_paths[i];
-    if (!strcmp(path, hf_path)) {
-      mode = DEV_MODE;
-    } else if (!strcmp(path, "/") || (!strncmp(path, hf_path, strlen(path)) &&
-                                      hf_path[strlen(path)] == '/')) {
-      mode = DIR_MODE;
+// Find the children the passthrough directory doesn't have, once it's been
+// read to the end
+static void finish_passthrough(struct open_dir *dir) {
+  struct readdir_ctx *ctx = &dir->ctx;
+  dir->passthrough_done = true;
+  ctx->num_tells = ctx->pos;
+  free(dir->tail);
+  dir->tail = malloc(ctx->num_children * sizeof(*dir->tail));
+  dir->num_tail = 0;
+  for (size_t i = 0; i < ctx->num_children; i++) {
+    if (!ctx->emitted[i]) {
+      dir->tail[dir->num_tail++] = i;
     }
   }
-  return mode;
 }
 
-static bool exists(const char *path) { return lookup_mode(path) >= 0; }
+// List an open hyperfile directory from offset, for as many entries as fit
+static void list_open_dir(struct open_dir *dir, const char *path,
+                          off_t offset, enum fuse_readdir_flags flags) {
+  struct readdir_ctx *ctx = &dir->ctx;
+  // Each listing from the start sees the children as they are then
+  if (!offset || !dir->read) {
+    read_children(dir->node, ctx);
+    dir->read = true;
+    ctx->pos = 0;
+    ctx->num_tells = 0;
+    dir->passthrough_done = false;
+    if (!dir->fh) {
+      finish_passthrough(dir);
+    }
+  }
+  if (ctx->plus && !ctx->child_st) {
+    stat_children(ctx);
+  }
 
-static int hyperfs_open(const char *path, struct fuse_file_info *fi) {
-  trace("%s(%s, %p)", __func__, path, fi);
-  fi->direct_io = 1;
-  if (exists(path)) {
-    return 0;
+  if (offset < 0 ||
+      offset > ctx->num_tells + (dir->passthrough_done ? dir->num_tail : 0)) {
+    return;
+  }
+  if (!dir->passthrough_done || offset < ctx->num_tells) {
+    struct xmp_dirp *d = (struct xmp_dirp *)(uintptr_t)dir->fh;
+    // Unless the kernel continues from the last entry returned, seek back
+    // to where the entry at offset was read
+    off_t from = d->offset;
+    if (!offset || offset != ctx->pos) {
+      from = offset ? ctx->tells[offset - 1] : 0;
+      ctx->pos = offset;
+    }
+    struct fuse_file_info dir_fi = {.fh = dir->fh};
+    xmp_readdir(path, ctx, readdir_filler, from, &dir_fi, flags);
+    if (d->entry) {
+      // Out of room, with an entry left over
+      return;
+    }
+    finish_passthrough(dir);
   } else {
-    return xmp_open(path, fi);
+    ctx->pos = offset;
   }
-}
 
-// Return whether a path is /proc/self or /proc/PID
-static bool is_proc_pid_path(const char *path)
-{
-  int pid, len;
-  bool is_proc_self = !strcmp(path, "/proc/self");
-  bool is_proc_pid = sscanf(path, "/proc/%d%n", &pid, &len) == 1 && len == strlen(path);
-  return is_proc_self || is_proc_pid;
+  bool plus = ctx->plus;
+  for (size_t k = ctx->pos - ctx->num_tells; k < dir->num_tail; k++) {
+    size_t i = dir->tail[k];
+    if (ctx->filler(ctx->buf, ctx->children[i]->name,
+                    plus ? &ctx->child_st[i] : NULL, ctx->pos + 1,
+                    plus ? FUSE_FILL_DIR_PLUS : 0)) {
+      break;
+    }
+    ctx->pos++;
+  }
 }
 
-static int hyperfs_getattr(const char *path, struct stat *st,
-                           struct fuse_file_info *fi) {
-  trace("%s(%s, st=%p, fi=%p)", __func__, path, st, fi);
-
-  memset(st, 0, sizeof(struct stat));
-  st->st_nlink = !strcmp(path, "/") ? 2 : 1;
-
-  int mode = lookup_mode(path);
-
-  if (mode >= 0) {
-    st->st_mode = mode;
-    if (mode == DEV_MODE) {
-      hyp_file_op((struct hyperfs_data){
-          .type = GETATTR,
-          .path = path,
-          .getattr.size = &st->st_size,
-      });
-    }
-    return 0;
-  } else if (is_proc_pid_path(path)) {
-    st->st_mode = S_IFLNK | 0777;
-    return 0;
-  } else {
-    return xmp_getattr(path, st, fi);
+static int hyperfs_opendir(const char *path, struct fuse_file_info *fi) {
+  trace("%s(%s, fi=%p)", __func__, path, fi);
+  struct hyperfile_node match;
+  struct hyperfile_node *node = lookup_node(path, &match);
+  int ret = xmp_opendir(path, fi);
+  if (!node || node->is_file) {
+    return ret;
   }
+  // The passthrough tree needn't have a hyperfile directory
+  struct open_dir *dir = calloc(1, sizeof(*dir));
+  dir->node = node == &match ? detach_node(&match, NULL) : node;
+  dir->fh = ret ? 0 : fi->fh;
+  dir->ctx.counted = true;
+  fi->fh = (uintptr_t)dir | HYPERFILE_FH;
+  return 0;
 }
 
 static int hyperfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                            off_t offset, struct fuse_file_info *fi,
                            enum fuse_readdir_flags flags) {
   trace("%s(%s, buf=%p, filler=%p, offset=%ld, fi=%p)", __func__, path, buf, filler, (long) offset, fi);
+  uint64_t start = now_ns();
 
-  int res;
-
-  res = xmp_readdir(path, buf, filler, offset, fi, flags);
-  if (lookup_mode(path) != DIR_MODE) {
-    return res;
+  struct open_dir *dir = open_dir(fi);
+  bool plus = flags & FUSE_READDIR_PLUS;
+  if (!dir && !plus) {
+    int ret = xmp_readdir(path, buf, filler, offset, fi, flags);
+    count_op(STATS_READDIR, false, start);
+    return ret;
   }
 
-  for (size_t i = 0; i < num_hyperfiles; i++) {
-    const char *hf_path = hyperfile_paths[i];
-    if (!strcmp(path, "/")) {
-      path = "";
-    }
-    size_t path_len = strlen(path);
-    if (!strncmp(path, hf_path, path_len) && hf_path[path_len] == '/') {
-      char *file_name = strdup(&hf_path[path_len + 1]);
-      *strchrnul(file_name, '/') = 0;
-      // Avoid duplicates with real underlying filesystem
-      char igloo_path[PATH_MAX];
-      snprintf(igloo_path, PATH_MAX, "%s%s/%s", options.passthrough_path, path,
-               file_name);
-      if (access(igloo_path, F_OK)) {
-        filler(buf, file_name, NULL, 0, 0);
-      }
-      free(file_name);
-    }
+  // Only passthrough entries that getattr would agree with get attributes
+  struct readdir_ctx plain = {0};
+  struct readdir_ctx *ctx = dir ? &dir->ctx : &plain;
+  ctx->buf = buf;
+  ctx->filler = filler;
+  ctx->plus = plus;
+  ctx->prefix_len = !strcmp(path, "/") ? 0 : strlen(path);
+  memcpy(ctx->path, path, ctx->prefix_len);
+  int ret = 0;
+  if (dir) {
+    list_open_dir(dir, path, offset, flags);
+  } else {
+    ret = xmp_readdir(path, ctx, readdir_filler, offset, fi, flags);
   }
 
+  count_op(STATS_READDIR, dir, start);
+  return ret;
+}
+
+static int hyperfs_releasedir(const char *path, struct fuse_file_info *fi) {
+  trace("%s(%s, fi=%p)", __func__, path, fi);
+  struct open_dir *dir = open_dir(fi);
+  if (!dir) {
+    return xmp_releasedir(path, fi);
+  }
+  if (dir->fh) {
+    struct fuse_file_info dir_fi = {.fh = dir->fh};
+    xmp_releasedir(path, &dir_fi);
+  }
+  free(dir->tail);
+  free(dir->ctx.tells);
+  free_children(&dir->ctx);
+  if (dir->node->detached) {
+    free_detached(dir->node);
+  }
+  free(dir);
   return 0;
 }
 
 static int hyperfs_truncate(const char *path, off_t offset,
                             struct fuse_file_info *fi) {
   trace("%s(%s, offset=%ld, fi=%p)", __func__, path, (long) offset, fi);
-  if (exists(path)) {
+  struct hyperfile_node match;
+  struct hyperfile_node *node = fi ? open_node(fi) : lookup_node(path, &match);
+  if (node && node->is_stats) {
+    return -EACCES;
+  } else if (node) {
+    forget_size(node);
     return 0;
   } else {
     return xmp_truncate(path, offset, fi);
@@ -274,42 +2531,206 @@ static int hyperfs_read(const char *path, char *buf, size_t size, off_t offset,
                         struct fuse_file_info *fi) {
   trace("%s(%s, buf=%p, size=%zu, offset=%ld, fi=%p)", __func__, path, buf, size, (long) offset, fi);
 
-  return lookup_mode(path) == DEV_MODE ? hyp_file_op((struct hyperfs_data){
-                                             .type = READ,
-                                             .path = path,
-                                             .read.buf = buf,
-                                             .read.size = size,
-                                             .read.offset = offset,
-                                         })
-                                       : xmp_read(path, buf, size, offset, fi);
+  struct hyperfile_node *node = open_node(fi);
+  if (!node || !node->is_file) {
+    return xmp_read(path, buf, size, offset, fi);
+  }
+  if (node->is_stats) {
+    return read_stats(open_hyperfile(fi), buf, size, offset);
+  }
+  int ret;
+  if (access_window(node, buf, size, offset, false, &ret)) {
+    return ret;
+  }
+  struct stream *stream = file_stream(fi);
+  if (stream) {
+    return read_stream(stream, buf, size, offset);
+  }
+  struct hyperfs_data data = hyperfile_target(READ, path, host_handle(fi));
+  data.read.buf = buf;
+  data.read.size = size;
+  data.read.offset = offset;
+  return hyp_file_op(data);
 }
 
 static int hyperfs_write(const char *path, const char *buf, size_t size,
                          off_t offset, struct fuse_file_info *fi) {
   trace("%s(%s, buf=%p, size=%zu, offset=%ld, fi=%p)", __func__, path, buf, size, (long) offset, fi);
 
-  return lookup_mode(path) == DEV_MODE ? hyp_file_op((struct hyperfs_data){
-                                             .type = WRITE,
-                                             .path = path,
-                                             .write.buf = buf,
-                                             .write.size = size,
-                                             .write.offset = offset,
-                                         })
-                                       : xmp_write(path, buf, size, offset, fi);
+  struct hyperfile_node *node = open_node(fi);
+  if (!node || !node->is_file) {
+    return xmp_write(path, buf, size, offset, fi);
+  }
+  if (node->is_stats) {
+    return -EACCES;
+  }
+  int ret;
+  if (access_window(node, (char *)buf, size, offset, true, &ret)) {
+    return ret;
+  }
+  struct stream *stream = file_stream(fi);
+  if (stream) {
+    ret = write_stream(stream, buf, size, offset);
+  } else {
+    struct hyperfs_data data = hyperfile_target(WRITE, path, host_handle(fi));
+    data.write.buf = buf;
+    data.write.size = size;
+    data.write.offset = offset;
+    ret = hyp_file_op(data);
+  }
+  forget_size(node);
+  return ret;
+}
+
+// Per-worker buffer for hyperfile data. It's populated and locked when
+// allocated, so the host can always reach it, and reads don't fault in a
+// freshly allocated buffer every time.
+struct bounce_buffer {
+  char *buf;
+  size_t size;
+};
+
+static pthread_key_t bounce_buffer_key;
+
+static void free_bounce_buffer(void *arg) {
+  struct bounce_buffer *bb = arg;
+  if (bb->buf) {
+    munmap(bb->buf, bb->size);
+  }
+  free(bb);
+}
+
+static char *get_bounce_buffer(size_t size) {
+  struct bounce_buffer *bb = pthread_getspecific(bounce_buffer_key);
+  if (bb && bb->size >= size) {
+    return bb->buf;
+  }
+  if (!bb) {
+    bb = calloc(1, sizeof(*bb));
+    if (!bb || pthread_setspecific(bounce_buffer_key, bb)) {
+      free(bb);
+      return NULL;
+    }
+  } else if (bb->buf) {
+    munmap(bb->buf, bb->size);
+  }
+  size = (size + page_size - 1) & ~(page_size - 1);
+  void *buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (buf == MAP_FAILED) {
+    *bb = (struct bounce_buffer){0};
+    return NULL;
+  }
+  mlock(buf, size);
+  *bb = (struct bounce_buffer){.buf = buf, .size = size};
+  return buf;
+}
+
+static int hyperfile_read_buf(const char *path, struct fuse_bufvec **bufp,
+                              size_t size, off_t offset,
+                              struct fuse_file_info *fi) {
+  // libfuse frees the buffer, so only the bytes actually read are copied out
+  char *bounce = get_bounce_buffer(size);
+  if (!bounce) {
+    return -ENOMEM;
+  }
+  int res = hyperfs_read(path, bounce, size, offset, fi);
+  if (res < 0) {
+    return res;
+  }
+  struct fuse_bufvec *src = malloc(sizeof(*src));
+  char *mem = malloc(res ? res : 1);
+  if (!src || !mem) {
+    free(src);
+    free(mem);
+    return -ENOMEM;
+  }
+  memcpy(mem, bounce, res);
+  *src = FUSE_BUFVEC_INIT(res);
+  src->buf[0].mem = mem;
+  *bufp = src;
+  return 0;
+}
+
+static int hyperfile_write_buf(const char *path, struct fuse_bufvec *buf,
+                               off_t offset, struct fuse_file_info *fi) {
+  // Data already in a single memory buffer can be sent as is
+  struct fuse_buf *first = &buf->buf[buf->idx];
+  if (buf->count - buf->idx == 1 && !(first->flags & FUSE_BUF_IS_FD)) {
+    return hyperfs_write(path, (char *)first->mem + buf->off,
+                         first->size - buf->off, offset, fi);
+  }
+  size_t size = fuse_buf_size(buf);
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+  dst.buf[0].mem = get_bounce_buffer(size);
+  if (!dst.buf[0].mem) {
+    return -ENOMEM;
+  }
+  ssize_t res = fuse_buf_copy(&dst, buf, 0);
+  if (res >= 0) {
+    res = hyperfs_write(path, dst.buf[0].mem, res, offset, fi);
+  }
+  return res;
+}
+
+// Hyperfile data has to pass through memory for the hypercall, while
+// passthrough files are handed to libfuse as descriptors it can splice.
+static int hyperfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+                            size_t size, off_t offset,
+                            struct fuse_file_info *fi) {
+  trace("%s(%s, bufp=%p, size=%zu, offset=%ld, fi=%p)", __func__, path, bufp, size, (long) offset, fi);
+  uint64_t start = now_ns();
+  struct hyperfile_node *node = open_node(fi);
+  bool hyperfile = node && node->is_file;
+  int ret = hyperfile ? hyperfile_read_buf(path, bufp, size, offset, fi)
+                      : xmp_read_buf(path, bufp, size, offset, fi);
+  count_op(STATS_READ, hyperfile, start);
+  return ret;
+}
+
+static int hyperfs_write_buf(const char *path, struct fuse_bufvec *buf,
+                             off_t offset, struct fuse_file_info *fi) {
+  trace("%s(%s, buf=%p, offset=%ld, fi=%p)", __func__, path, buf, (long) offset, fi);
+  uint64_t start = now_ns();
+  struct hyperfile_node *node = open_node(fi);
+  bool hyperfile = node && node->is_file;
+  int ret = hyperfile ? hyperfile_write_buf(path, buf, offset, fi)
+                      : xmp_write_buf(path, buf, offset, fi);
+  count_op(STATS_WRITE, hyperfile, start);
+  return ret;
 }
 
 static int hyperfs_ioctl(const char *path, unsigned int cmd, void *arg,
                          struct fuse_file_info *fi, unsigned int flags,
                          void *data_) {
   trace("%s(%s, cmd=%u, arg=%p, fi=%p, flags=%x, data=%p)", __func__, path, cmd, arg, fi, flags, data_);
-  return lookup_mode(path) == DEV_MODE
-             ? hyp_file_op((struct hyperfs_data){
-                   .type = IOCTL,
-                   .path = path,
-                   .ioctl.cmd = cmd,
-                   .ioctl.data = data_,
-               })
-             : xmp_ioctl(path, cmd, arg, fi, flags, data_);
+  uint64_t start = now_ns();
+  // A directory's fi->fh isn't a descriptor, so it's opened by path
+  if (flags & FUSE_IOCTL_DIR) {
+    int ret = xmp_ioctl(path, cmd, arg, NULL, flags, data_);
+    count_op(STATS_IOCTL, false, start);
+    return ret;
+  }
+  struct hyperfile_node *node = open_node(fi);
+  if (!node || !node->is_file) {
+    int ret = xmp_ioctl(path, cmd, arg, fi, flags, data_);
+    count_op(STATS_IOCTL, false, start);
+    return ret;
+  }
+  if (node->is_stats) {
+    return -ENOTTY;
+  }
+  flush_window(node, path, fi);
+  if (file_stream(fi)) {
+    sync_stream(file_stream(fi));
+  }
+  struct hyperfs_data data = hyperfile_target(IOCTL, path, host_handle(fi));
+  data.ioctl.cmd = cmd;
+  data.ioctl.data = data_;
+  int ret = hyp_file_op(data);
+  forget_size(node);
+  count_op(STATS_IOCTL, true, start);
+  return ret;
 }
 
 static int hyperfs_readlink(const char *path, char *buf, size_t size) {
@@ -326,26 +2747,282 @@ static int hyperfs_readlink(const char *path, char *buf, size_t size) {
 
 static int hyperfs_release(const char *path, struct fuse_file_info *fi) {
   trace("%s(%s, fi=%p)", __func__, path, fi);
-  if (exists(path)) {
-    return 0;
-  } else {
+  struct open_hyperfile *of = open_hyperfile(fi);
+  drop_pending_polls(fi);
+  if (!of) {
     return xmp_release(path, fi);
   }
+  if (of->stats) {
+    release_stats(of);
+  }
+  if (of->node->is_file && !of->node->is_stats) {
+    flush_window(of->node, path, fi);
+  }
+  if (of->stream) {
+    close_stream(of->stream);
+  }
+  if (of->handle) {
+    hyp_file_op(hyperfile_target(RELEASE, path, of->handle));
+  }
+  free_open_hyperfile(of);
+  return 0;
+}
+
+// Ask the host which paths changed (e.g. a hyperfile's size) and drop them
+// from the kernel's caches. The first call finds out whether the host
+// reports invalidations at all, so hosts that don't aren't asked again.
+static void *invalidation_thread(void *arg) {
+  struct fuse *fuse = arg;
+  char path[HYPERFILE_PATH_MAX];
+  for (bool probe = true;; probe = false) {
+    path[0] = probe ? INVALIDATED_PATH_UNANSWERED : '\0';
+    hc(HYP_GET_INVALIDATED_PATH, (void *[]){path}, 1);
+    if (path[0] == INVALIDATED_PATH_UNANSWERED) {
+      trace("%s: host doesn't report invalidated paths", __func__);
+      return NULL;
+    }
+    if (path[0]) {
+      trace("%s: invalidating %s", __func__, path);
+      struct hyperfile_node *node = index_find(path, strlen(path));
+      if (node) {
+        forget_size(node);
+      }
+      if (options.cache_timeout > 0) {
+        fuse_invalidate_path(fuse, path);
+      }
+    } else {
+      usleep(options.invalidate_interval_ms * 1000);
+    }
+  }
+  return NULL;
+}
+
+// Hosts that add and remove hyperfiles at runtime number each set of
+// changes with a generation. The index is updated with just the paths that
+// changed, and the kernel only has to forget those and any directories that
+// came or went with them. Paths the kernel has cached as missing only show up
+// once --cache-timeout expires, as notifying it about those needs the
+// low-level API.
+static uint64_t hyperfile_generation = GENERATION_CURRENT;
+
+// Called before the hyperfile paths are loaded, so changes made while
+// they're loading are applied again rather than missed. Hosts that don't
+// track changes leave the generation alone.
+static void changes_init(void) {
+  if (!host_protocol) {
+    return;
+  }
+  size_t size = 0, needed = 0;
+  hc(HYP_GET_HYPERFILE_CHANGES,
+     (void *[]){&hyperfile_generation, NULL, &size, &needed}, 4);
+}
+
+struct hyperfile_change {
+  char path[HYPERFILE_PATH_MAX];
+  size_t len;
+  uint32_t kind;
+};
+
+// Copy out the next usable entry of a change list. /.hyperfs is served here,
+// so changes under it are skipped.
+static bool next_change(const char *buf, size_t size, size_t *off,
+                        struct hyperfile_change *c) {
+  struct hyperfs_list_entry entry;
+  while (size - *off >= sizeof(entry)) {
+    memcpy(&entry, &buf[*off], sizeof(entry));
+    *off += sizeof(entry);
+    if (entry.len > size - *off) {
+      break;
+    }
+    const char *path = &buf[*off];
+    *off += entry.len;
+    if (!valid_hyperfile_path(path, entry.len) ||
+        entry.len >= HYPERFILE_PATH_MAX || memchr(path, '\0', entry.len)) {
+      continue;
+    }
+    memcpy(c->path, path, entry.len);
+    c->path[entry.len] = '\0';
+    c->len = entry.len;
+    c->kind = entry.kind;
+    if (strncmp(c->path, "/.hyperfs", 9) ||
+        (c->path[9] && c->path[9] != '/')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Length of the shortest prefix of a path (ending at a '/' or the end of the
+// path) missing from the index, or 0 if it's all there. Called with
+// index_lock held.
+static size_t missing_prefix_len(const char *path, size_t len) {
+  for (size_t i = 1; i <= len; i++) {
+    if ((i == len || path[i] == '/') && !index_get(path, i)) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+static void apply_hyperfile_changes(struct fuse *fuse, const char *buf,
+                                    size_t size) {
+  // Paths that changed between hyperfile and passthrough
+  char **stale = NULL;
+  size_t num_stale = 0;
+  struct hyperfile_change c;
+  pthread_rwlock_wrlock(&index_lock);
+  for (size_t off = 0; next_change(buf, size, &off, &c);) {
+    size_t changed = 0;
+    if (c.kind == HYPERFILE_FILE) {
+      changed = missing_prefix_len(c.path, c.len);
+      char *path = strdup(c.path);
+      bool took_path = false;
+      index_path(path, true, &took_path);
+      if (!took_path) {
+        free(path);
+      }
+      forget_absent(c.path, c.len);
+    } else if (c.kind == HYPERFILE_NONE && index_get(c.path, c.len)) {
+      index_remove(c.path, c.len);
+      changed = missing_prefix_len(c.path, c.len);
+    }
+    for (size_t i = changed; changed && i <= c.len; i++) {
+      if (i == c.len || c.path[i] == '/') {
+        stale = realloc(stale, (num_stale + 1) * sizeof(*stale));
+        stale[num_stale++] = strndup(c.path, i);
+      }
+    }
+  }
+  pthread_rwlock_unlock(&index_lock);
+
+  // Invalidating can wait on ops that need index_lock
+  for (size_t i = 0; i < num_stale; i++) {
+    trace("%s: invalidating %s", __func__, stale[i]);
+    fuse_invalidate_path(fuse, stale[i]);
+    free(stale[i]);
+  }
+  free(stale);
+}
+
+static void *changes_thread(void *arg) {
+  struct fuse *fuse = arg;
+  size_t size = 4096;
+  char *buf = malloc(size);
+  for (;;) {
+    uint64_t generation = hyperfile_generation;
+    size_t buf_size = size, needed = 0;
+    page_in(buf, size, true);
+    hc(HYP_GET_HYPERFILE_CHANGES,
+       (void *[]){&generation, buf, &buf_size, &needed}, 4);
+    if (needed > size) {
+      size = needed;
+      buf = realloc(buf, size);
+    } else if (generation != hyperfile_generation) {
+      apply_hyperfile_changes(fuse, buf, needed);
+      hyperfile_generation = generation;
+    } else {
+      usleep(options.changes_interval_ms * 1000);
+    }
+  }
+  return NULL;
+}
+
+static void *hyperfs_init(struct fuse_conn_info *conn,
+                          struct fuse_config *cfg) {
+  trace("%s(conn=%p, cfg=%p)", __func__, conn, cfg);
+  void *ret = xmp_init(conn, cfg);
+#ifdef FUSE_CAP_DIRECT_IO_ALLOW_MMAP
+  if (conn->capable & FUSE_CAP_DIRECT_IO_ALLOW_MMAP) {
+    conn->want |= FUSE_CAP_DIRECT_IO_ALLOW_MMAP;
+    direct_io_mmap = true;
+  }
+#endif
+  // Registered here rather than in main() so it's done after daemonizing
+  ring_init();
+  pthread_t stats_thread;
+  if (!pthread_create(&stats_thread, NULL, signal_thread, NULL)) {
+    pthread_detach(stats_thread);
+  }
+  if ((options.cache_timeout > 0 || options.size_cache_ttl > 0) &&
+      host_protocol) {
+    pthread_t thread;
+    if (!pthread_create(&thread, NULL, invalidation_thread,
+                        fuse_get_context()->fuse)) {
+      pthread_detach(thread);
+    }
+  }
+  if (hyperfile_generation != GENERATION_CURRENT) {
+    pthread_t thread;
+    if (!pthread_create(&thread, NULL, changes_thread,
+                        fuse_get_context()->fuse)) {
+      pthread_detach(thread);
+    }
+  }
+  return ret;
+}
+
+static int hyperfs_poll(const char *path, struct fuse_file_info *fi,
+                        struct fuse_pollhandle *ph, unsigned *reventsp) {
+  trace("%s(%s, fi=%p, ph=%p, events=%x)", __func__, path, fi, ph, fi->poll_events);
+  struct hyperfile_node *node = open_node(fi);
+  if (node && (!node->is_file || node->is_stats)) {
+    *reventsp = DEFAULT_POLLMASK;
+    if (ph) {
+      fuse_pollhandle_destroy(ph);
+    }
+    return 0;
+  }
+  // Passthrough files are polled through their backing descriptor
+  int fd = node ? -1 : (int)fi->fh;
+  unsigned int events = fi->poll_events ? fi->poll_events : DEFAULT_POLLMASK;
+  *reventsp = node ? poll_hyperfile(path, host_handle(fi), events)
+                   : poll_fd(fd, events);
+  if (ph) {
+    if (*reventsp & events) {
+      fuse_pollhandle_destroy(ph);
+    } else {
+      add_pending_poll(fi, fd, path, host_handle(fi), events, ph);
+    }
+  }
+  return 0;
+}
+
+static int hyperfs_fsync(const char *path, int isdatasync,
+                         struct fuse_file_info *fi) {
+  trace("%s(%s, isdatasync=%d, fi=%p)", __func__, path, isdatasync, fi);
+  struct hyperfile_node *node = open_node(fi);
+  if (!node || !node->is_file) {
+    return xmp_fsync(path, isdatasync, fi);
+  }
+  if (node->is_stats) {
+    return 0;
+  }
+  int ret = flush_window(node, path, fi);
+  if (file_stream(fi)) {
+    int err = sync_stream(file_stream(fi));
+    ret = ret < 0 ? ret : err;
+  }
+  return ret;
 }
 
 static const struct fuse_operations fops = {
     .open = hyperfs_open,
     .getattr = hyperfs_getattr,
+    .opendir = hyperfs_opendir,
     .readdir = hyperfs_readdir,
+    .releasedir = hyperfs_releasedir,
     .truncate = hyperfs_truncate,
     .read = hyperfs_read,
     .write = hyperfs_write,
+    .read_buf = hyperfs_read_buf,
+    .write_buf = hyperfs_write_buf,
     .ioctl = hyperfs_ioctl,
+    .poll = hyperfs_poll,
 
     .readlink = hyperfs_readlink,
     .release = hyperfs_release,
 
-    .init = xmp_init,
+    .init = hyperfs_init,
     .mknod = xmp_mknod,
     .mkdir = xmp_mkdir,
     .unlink = xmp_unlink,
@@ -357,27 +3034,194 @@ static const struct fuse_operations fops = {
     .chown = xmp_chown,
     .create = xmp_create,
     .statfs = xmp_statfs,
-    .fsync = xmp_fsync,
+    .fsync = hyperfs_fsync,
 };
 
+// Fetch the paths as a blob, PATH_BLOB_CHUNK bytes per hypercall. The lengths
+// are squeezed out in place to leave the NUL-terminated paths, so the blob is
+// the only memory they take. Returns false on hosts without the blob.
+static bool load_hyperfile_path_blob(void) {
+  if (!host_protocol) {
+    return false;
+  }
+  size_t size = 0;
+  hc(HYP_GET_HYPERFILE_PATHS_SIZE, (void *[]){&size}, 1);
+  char *blob = size ? malloc(size) : NULL;
+  if (!blob) {
+    return false;
+  }
+  for (size_t off = 0; off < size; off += PATH_BLOB_CHUNK) {
+    size_t chunk_off = off;
+    size_t chunk_size = size - off < PATH_BLOB_CHUNK ? size - off
+                                                     : PATH_BLOB_CHUNK;
+    page_in(&blob[off], chunk_size, true);
+    hc(HYP_READ_HYPERFILE_PATHS,
+       (void *[]){&blob[off], &chunk_off, &chunk_size}, 3);
+  }
+
+  // Each path moves back over its own length and the lengths before it, so
+  // it never overwrites a length that hasn't been read yet
+  size_t r = 0, w = 0, n = 0;
+  while (size - r >= sizeof(uint32_t)) {
+    uint32_t len;
+    memcpy(&len, &blob[r], sizeof(len));
+    r += sizeof(len);
+    if (len > size - r) {
+      break;
+    }
+    memmove(&blob[w], &blob[r], len);
+    blob[w + len] = '\0';
+    w += len + 1;
+    r += len;
+    n++;
+  }
+  if (!n) {
+    free(blob);
+    return false;
+  }
+  char *paths = realloc(blob, w);
+  if (!paths) {
+    paths = blob;
+  }
+
+  hyperfile_paths = malloc(n * sizeof(*hyperfile_paths));
+  for (size_t i = 0; i < n; i++) {
+    hyperfile_paths[i] = paths;
+    paths += strlen(paths) + 1;
+  }
+  num_hyperfiles = n;
+  return true;
+}
+
+// Older hosts fill a HYPERFILE_PATH_MAX buffer per path, which are copied
+// into one allocation of just the path bytes once they have
+static void load_hyperfile_path_table(void) {
+  hc(HYP_GET_NUM_HYPERFILES, (void *[]){&num_hyperfiles}, 1);
+  char **bufs = malloc(num_hyperfiles * sizeof(*bufs));
+  for (size_t i = 0; i < num_hyperfiles; i++) {
+    bufs[i] = calloc(HYPERFILE_PATH_MAX, 1);
+  }
+  hc(HYP_GET_HYPERFILE_PATHS, (void **)bufs, num_hyperfiles);
+
+  size_t size = 0;
+  for (size_t i = 0; i < num_hyperfiles; i++) {
+    size += strnlen(bufs[i], HYPERFILE_PATH_MAX - 1) + 1;
+  }
+  char *paths = malloc(size);
+  hyperfile_paths = malloc(num_hyperfiles * sizeof(*hyperfile_paths));
+  for (size_t i = 0; i < num_hyperfiles; i++) {
+    size_t len = strnlen(bufs[i], HYPERFILE_PATH_MAX - 1);
+    memcpy(paths, bufs[i], len);
+    paths[len] = '\0';
+    hyperfile_paths[i] = paths;
+    paths += len + 1;
+    free(bufs[i]);
+  }
+  free(bufs);
+}
+
 static void load_hyperfile_paths(void) {
   trace("%s()", __func__);
-  hc(HYP_GET_NUM_HYPERFILES, (void *[]){&num_hyperfiles}, 1);
-  hyperfile_paths = calloc(num_hyperfiles, sizeof(*hyperfile_paths));
+  if (!load_hyperfile_path_blob()) {
+    load_hyperfile_path_table();
+  }
+  for (size_t i = 0; i < num_hyperfiles; i++) {
+    const char *path = hyperfile_paths[i];
+    if (valid_hyperfile_path(path, strlen(path))) {
+      index_hyperfile(path);
+    } else {
+      trace("%s: skipping invalid path \"%s\"", __func__, path);
+    }
+  }
+}
+
+// /.hyperfs/stats is served here, and nothing else is under /.hyperfs
+static void index_stats_file(void) {
+  index_hyperfile(STATS_PATH);
+  index_find(STATS_PATH, strlen(STATS_PATH))->is_stats = true;
+  index_find(STATS_PATH, strlen("/.hyperfs"))->listed = true;
+}
+
+// Prime the size cache with every hyperfile's size in a single hypercall.
+// Sizes the host doesn't fill in are left uncached.
+static void load_hyperfile_sizes(void) {
+  trace("%s()", __func__);
+  if (!host_protocol) {
+    return;
+  }
+  off_t *sizes = malloc(num_hyperfiles * sizeof(*sizes));
+  off_t **size_ptrs = malloc(num_hyperfiles * sizeof(*size_ptrs));
   for (size_t i = 0; i < num_hyperfiles; i++) {
-    hyperfile_paths[i] = calloc(HYPERFILE_PATH_MAX, 1);
+    sizes[i] = -1;
+    size_ptrs[i] = &sizes[i];
+  }
+  hc(HYP_GET_HYPERFILE_SIZES, (void **)size_ptrs, num_hyperfiles);
+  uint64_t now = now_ns();
+  for (size_t i = 0; i < num_hyperfiles; i++) {
+    if (sizes[i] >= 0) {
+      const char *path = hyperfile_paths[i];
+      struct hyperfile_node *node = index_find(path, strlen(path));
+      if (node) {
+        cache_size(node, sizes[i], now);
+      }
+    }
   }
-  hc(HYP_GET_HYPERFILE_PATHS, (void **)hyperfile_paths, num_hyperfiles);
+  free(size_ptrs);
+  free(sizes);
 }
 
 int main(int argc, char *argv[]) {
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  options.invalidate_interval_ms = 100;
+  options.retry_spins = 64;
+  options.retry_max_sleep_us = 1000;
+  options.poll_interval_ms = 10;
+  options.poll_max_interval_ms = 1000;
+  options.stream_flush_interval_ms = 10;
+  options.lazy_cache_size = 4096;
+  options.changes_interval_ms = 100;
   if (fuse_opt_parse(&args, &options, option_spec, NULL)) {
     return 1;
   }
   if (!options.passthrough_path) {
     fputs("error: missing --passthrough-path\n", stderr);
+    return 1;
+  }
+  igloo_root_fd = open(options.passthrough_path, O_PATH | O_DIRECTORY);
+  if (igloo_root_fd == -1) {
+    perror("error: --passthrough-path");
+    return 1;
+  }
+  trace_init();
+  // Leave SIGUSR1 to signal_thread. Every thread libfuse starts inherits this.
+  sigset_t usr1;
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+  page_size = sysconf(_SC_PAGESIZE);
+  protocol_init();
+  if (options.lazy_hyperfiles && !lazy_init()) {
+    fputs("warning: host can't look up hyperfiles, loading them all\n",
+          stderr);
+    options.lazy_hyperfiles = 0;
+  }
+  if (options.changes_interval_ms) {
+    changes_init();
+  }
+  if (!options.lazy_hyperfiles) {
+    load_hyperfile_paths();
+  }
+  load_hyperfile_patterns();
+  index_stats_file();
+  if (options.size_cache_ttl > 0) {
+    load_hyperfile_sizes();
+  }
+  pthread_key_create(&bounce_buffer_key, free_bounce_buffer);
+  // Give each worker its own /dev/fuse queue by default. This is inserted
+  // ahead of the user's arguments, so libfuse's -o max_threads and
+  // -o max_idle_threads can be combined with it as usual.
+  if (!options.no_clone_fd) {
+    fuse_opt_insert_arg(&args, 1, "-oclone_fd");
   }
-  load_hyperfile_paths();
   return fuse_main(args.argc, args.argv, &fops, NULL);
 }
@@ -47,13 +47,144 @@
  * https://raw.githubusercontent.com/libfuse/libfuse/26fa6c1f03f564673f47699eacae45e58fcc0b2d/example/passthrough_helpers.h
  */
 
-static int igloo_rebase_path(const char *src, char *dst) {
-  int ret = snprintf(dst, PATH_MAX, "%s%s", options.passthrough_path, src) <
-                 PATH_MAX
-             ? 0
-             : -ENAMETOOLONG;
-  trace("%s(src=%s, dst=%s)", __func__, src, dst);
-  return ret;
+/* O_PATH descriptor for --passthrough-path. Operations resolve FUSE paths
+   relative to it with the *at() syscalls instead of building absolute
+   paths. */
+static int igloo_root_fd = -1;
+
+static const char *igloo_rebase_path(const char *path) {
+  const char *rel = path[1] ? &path[1] : ".";
+  trace("%s(path=%s, rel=%s)", __func__, path, rel);
+  return rel;
+}
+
+#ifdef FUSE_CAP_PASSTHROUGH
+#ifndef FUSE_DEV_IOC_BACKING_OPEN
+struct fuse_backing_map {
+  int32_t fd;
+  uint32_t flags;
+  uint64_t padding;
+};
+#define FUSE_DEV_IOC_MAGIC 229
+#define FUSE_DEV_IOC_BACKING_OPEN                                              \
+  _IOW(FUSE_DEV_IOC_MAGIC, 1, struct fuse_backing_map)
+#define FUSE_DEV_IOC_BACKING_CLOSE _IOW(FUSE_DEV_IOC_MAGIC, 2, uint32_t)
+#endif
+
+/* Whether the kernel can service I/O on backing files itself (Linux 6.9+),
+   so plain files don't round trip through xmp_read()/xmp_write().
+   Cleared by whichever worker first finds it isn't permitted to register
+   backing files, so it's accessed atomically. */
+static bool igloo_passthrough;
+
+/* Backing ids registered with the kernel, indexed by backing file
+   descriptor. The high-level API doesn't hand fi->backing_id back to
+   release, so this is how xmp_release() finds it. */
+static int32_t *igloo_backing_ids;
+static size_t igloo_num_backing_ids;
+static pthread_mutex_t igloo_backing_ids_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int igloo_fuse_dev_fd(void) {
+  return fuse_session_fd(fuse_get_session(fuse_get_context()->fuse));
+}
+
+static void igloo_passthrough_open(int fd, struct fuse_file_info *fi) {
+  struct stat st;
+
+  if (!__atomic_load_n(&igloo_passthrough, __ATOMIC_RELAXED))
+    return;
+
+  /* FIFOs, sockets and devices keep going through xmp_read()/xmp_write() */
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    return;
+
+  struct fuse_backing_map map = {.fd = fd};
+  int backing_id = ioctl(igloo_fuse_dev_fd(), FUSE_DEV_IOC_BACKING_OPEN, &map);
+  if (backing_id <= 0) {
+    int err = errno;
+    trace("%s: BACKING_OPEN failed: %s", __func__, strerror(err));
+    /* EPERM without CAP_SYS_ADMIN won't change, but other errors, like
+       EOPNOTSUPP for a backing file without read_iter, are per file */
+    if (err == EPERM)
+      __atomic_store_n(&igloo_passthrough, false, __ATOMIC_RELAXED);
+    return;
+  }
+
+  pthread_mutex_lock(&igloo_backing_ids_lock);
+  if (fd >= igloo_num_backing_ids) {
+    size_t n = igloo_num_backing_ids ? igloo_num_backing_ids : 64;
+    while (n <= fd)
+      n *= 2;
+    igloo_backing_ids =
+        realloc(igloo_backing_ids, n * sizeof(*igloo_backing_ids));
+    memset(&igloo_backing_ids[igloo_num_backing_ids], 0,
+           (n - igloo_num_backing_ids) * sizeof(*igloo_backing_ids));
+    igloo_num_backing_ids = n;
+  }
+  igloo_backing_ids[fd] = backing_id;
+  pthread_mutex_unlock(&igloo_backing_ids_lock);
+
+  fi->backing_id = backing_id;
+  fi->direct_io = 0;
+}
+
+static void igloo_passthrough_release(int fd) {
+  int32_t backing_id = 0;
+
+  pthread_mutex_lock(&igloo_backing_ids_lock);
+  if (fd < igloo_num_backing_ids) {
+    backing_id = igloo_backing_ids[fd];
+    igloo_backing_ids[fd] = 0;
+  }
+  pthread_mutex_unlock(&igloo_backing_ids_lock);
+
+  if (backing_id)
+    ioctl(igloo_fuse_dev_fd(), FUSE_DEV_IOC_BACKING_CLOSE, &backing_id);
+}
+#else
+static void igloo_passthrough_open(int fd, struct fuse_file_info *fi) {
+  (void)fd;
+  (void)fi;
+}
+
+static void igloo_passthrough_release(int fd) { (void)fd; }
+#endif
+
+/* With --page-cache, passthrough files are opened without direct_io, and
+   their cached pages are kept across opens unless the file's mtime or
+   size has changed since it was last opened. Hyperfiles never go through
+   here, so their pages are never kept. The attributes are remembered in a
+   fixed-size table indexed by inode; a file whose slot was taken by
+   another just has its pages dropped on its next open. */
+enum { IGLOO_OPEN_ATTRS_SIZE = 4096 };
+
+static struct igloo_open_attrs {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  off_t size;
+} igloo_open_attrs[IGLOO_OPEN_ATTRS_SIZE];
+static pthread_mutex_t igloo_open_attrs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void igloo_keep_cache(int fd, struct fuse_file_info *fi) {
+  struct stat st;
+
+  fi->keep_cache = 0;
+  if (!options.page_cache || fi->direct_io || fstat(fd, &st) == -1)
+    return;
+
+  struct igloo_open_attrs *attrs =
+      &igloo_open_attrs[(st.st_ino ^ st.st_dev) % IGLOO_OPEN_ATTRS_SIZE];
+  pthread_mutex_lock(&igloo_open_attrs_lock);
+  fi->keep_cache = attrs->ino == st.st_ino && attrs->dev == st.st_dev &&
+                   attrs->mtime.tv_sec == st.st_mtim.tv_sec &&
+                   attrs->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+                   attrs->size == st.st_size;
+  attrs->dev = st.st_dev;
+  attrs->ino = st.st_ino;
+  attrs->mtime = st.st_mtim;
+  attrs->size = st.st_size;
+  pthread_mutex_unlock(&igloo_open_attrs_lock);
 }
 
 /*
@@ -82,7 +213,6 @@ static int mknod_wrapper(int dirfd, const char *path, const char *link,
 }
 
 static void *xmp_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
-  (void)conn;
   cfg->use_ino = 1;
 
   /* parallel_direct_writes feature depends on direct_io features.
@@ -92,16 +222,33 @@ static void *xmp_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
   // cfg->direct_io = 1;
   cfg->parallel_direct_writes = 1;
 
-  /* Pick up changes from lower filesystem right away. This is
-     also necessary for better hardlink support. When the kernel
-     calls the unlink() handler, it does not know the inode of
-     the to-be-removed entry and can therefore not invalidate
-     the cache of the associated inode - resulting in an
-     incorrect st_nlink value being reported for any remaining
-     hardlinks to this inode. */
-  cfg->entry_timeout = 0;
-  cfg->attr_timeout = 0;
-  cfg->negative_timeout = 0;
+  /* Let libfuse splice file data between /dev/fuse and the backing
+     files returned from xmp_read_buf() and passed to xmp_write_buf() */
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE |
+                                 FUSE_CAP_SPLICE_MOVE | FUSE_CAP_SPLICE_READ);
+
+#ifdef FUSE_CAP_PASSTHROUGH
+  if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+    conn->want |= FUSE_CAP_PASSTHROUGH;
+    __atomic_store_n(&igloo_passthrough, true, __ATOMIC_RELAXED);
+  }
+#endif
+
+  /* Pick up changes from lower filesystem right away, unless
+     --cache-timeout was given. This is also necessary for better
+     hardlink support. When the kernel calls the unlink() handler,
+     it does not know the inode of the to-be-removed entry and can
+     therefore not invalidate the cache of the associated inode -
+     resulting in an incorrect st_nlink value being reported for
+     any remaining hardlinks to this inode. */
+  cfg->entry_timeout = options.cache_timeout;
+  cfg->attr_timeout = options.cache_timeout;
+  cfg->negative_timeout = options.cache_timeout;
+
+  /* Attributes from readdirplus would expire as soon as they arrived,
+     so without --cache-timeout it would only slow listings down */
+  if (options.cache_timeout <= 0)
+    conn->want &= ~(FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
 
   return NULL;
 }
@@ -110,12 +257,9 @@ static int xmp_getattr(const char *path, struct stat *stbuf,
                        struct fuse_file_info *fi) {
   (void)fi;
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
-  res = lstat(igloo_path, stbuf);
+  const char *igloo_path = igloo_rebase_path(path);
+  res = fstatat(igloo_root_fd, igloo_path, stbuf, AT_SYMLINK_NOFOLLOW);
   if (res == -1)
     return -errno;
 
@@ -124,12 +268,9 @@ static int xmp_getattr(const char *path, struct stat *stbuf,
 
 static int xmp_readlink(const char *path, char *buf, size_t size) {
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
-  res = readlink(igloo_path, buf, size - 1);
+  const char *igloo_path = igloo_rebase_path(path);
+  res = readlinkat(igloo_root_fd, igloo_path, buf, size - 1);
   if (res == -1)
     return -errno;
 
@@ -137,46 +278,106 @@ static int xmp_readlink(const char *path, char *buf, size_t size) {
   return 0;
 }
 
-static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                       off_t offset, struct fuse_file_info *fi,
-                       enum fuse_readdir_flags flags) {
+/* Open directory stream kept across readdir calls, so a large directory
+   is read in pages from where the previous call stopped. entry is one
+   that was read but didn't fit in the last reply, and offset is the
+   telldir() position just before it. */
+struct xmp_dirp {
   DIR *dp;
-  struct dirent *de;
-  char igloo_path[PATH_MAX];
-  int res;
+  struct dirent *entry;
+  off_t offset;
+};
 
-  (void)offset;
-  (void)fi;
-  (void)flags;
+static int xmp_opendir(const char *path, struct fuse_file_info *fi) {
+  int res;
+  struct xmp_dirp *d = malloc(sizeof(struct xmp_dirp));
+  if (d == NULL)
+    return -ENOMEM;
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
+  const char *igloo_path = igloo_rebase_path(path);
+  int fd = openat(igloo_root_fd, igloo_path, O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
+    res = -errno;
+    free(d);
     return res;
-  dp = opendir(igloo_path);
-  if (dp == NULL)
-    return -errno;
+  }
+  d->dp = fdopendir(fd);
+  if (d->dp == NULL) {
+    res = -errno;
+    close(fd);
+    free(d);
+    return res;
+  }
+  d->offset = 0;
+  d->entry = NULL;
+
+  fi->fh = (unsigned long)d;
+  return 0;
+}
+
+static inline struct xmp_dirp *get_dirp(struct fuse_file_info *fi) {
+  return (struct xmp_dirp *)(uintptr_t)fi->fh;
+}
+
+static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                       off_t offset, struct fuse_file_info *fi,
+                       enum fuse_readdir_flags flags) {
+  struct xmp_dirp *d = get_dirp(fi);
 
-  while ((de = readdir(dp)) != NULL) {
+  (void)path;
+  if (offset != d->offset) {
+    seekdir(d->dp, offset);
+    d->entry = NULL;
+    d->offset = offset;
+  }
+
+  /* Entries are passed with their telldir() offsets, so libfuse replies
+     with as many as fit and the kernel continues from the last one it
+     used. For readdirplus, stat each entry relative to the directory,
+     so the kernel doesn't have to getattr them one by one. Entries that
+     can't be stat'ed are passed without attributes. */
+  while (1) {
     struct stat st;
-    memset(&st, 0, sizeof(st));
-    st.st_ino = de->d_ino;
-    st.st_mode = de->d_type << 12;
-    if (filler(buf, de->d_name, &st, 0, 0))
+    off_t nextoff;
+    enum fuse_fill_dir_flags fill_flags = 0;
+
+    if (!d->entry) {
+      d->entry = readdir(d->dp);
+      if (!d->entry)
+        break;
+    }
+    if ((flags & FUSE_READDIR_PLUS) &&
+        !fstatat(dirfd(d->dp), d->entry->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+      fill_flags = FUSE_FILL_DIR_PLUS;
+    } else {
+      memset(&st, 0, sizeof(st));
+      st.st_ino = d->entry->d_ino;
+      st.st_mode = d->entry->d_type << 12;
+    }
+    nextoff = telldir(d->dp);
+    if (filler(buf, d->entry->d_name, &st, nextoff, fill_flags))
       break;
+
+    d->entry = NULL;
+    d->offset = nextoff;
   }
 
-  closedir(dp);
+  return 0;
+}
+
+static int xmp_releasedir(const char *path, struct fuse_file_info *fi) {
+  struct xmp_dirp *d = get_dirp(fi);
+  (void)path;
+  closedir(d->dp);
+  free(d);
   return 0;
 }
 
 static int xmp_mknod(const char *path, mode_t mode, dev_t rdev) {
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
-  res = mknod_wrapper(AT_FDCWD, igloo_path, NULL, mode, rdev);
+  const char *igloo_path = igloo_rebase_path(path);
+  res = mknod_wrapper(igloo_root_fd, igloo_path, NULL, mode, rdev);
   if (res == -1)
     return -errno;
 
@@ -185,12 +386,9 @@ static int xmp_mknod(const char *path, mode_t mode, dev_t rdev) {
 
 static int xmp_mkdir(const char *path, mode_t mode) {
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
-  res = mkdir(igloo_path, mode);
+  const char *igloo_path = igloo_rebase_path(path);
+  res = mkdirat(igloo_root_fd, igloo_path, mode);
   if (res == -1)
     return -errno;
 
@@ -199,12 +397,9 @@ static int xmp_mkdir(const char *path, mode_t mode) {
 
 static int xmp_unlink(const char *path) {
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
-  res = unlink(igloo_path);
+  const char *igloo_path = igloo_rebase_path(path);
+  res = unlinkat(igloo_root_fd, igloo_path, 0);
   if (res == -1)
     return -errno;
 
@@ -213,12 +408,9 @@ static int xmp_unlink(const char *path) {
 
 static int xmp_rmdir(const char *path) {
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
-  res = rmdir(igloo_path);
+  const char *igloo_path = igloo_rebase_path(path);
+  res = unlinkat(igloo_root_fd, igloo_path, AT_REMOVEDIR);
   if (res == -1)
     return -errno;
 
@@ -227,12 +419,9 @@ static int xmp_rmdir(const char *path) {
 
 static int xmp_symlink(const char *from, const char *to) {
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(to, igloo_path);
-  if (res < 0)
-    return res;
-  res = symlink(from, igloo_path);
+  const char *igloo_path = igloo_rebase_path(to);
+  res = symlinkat(from, igloo_root_fd, igloo_path);
   if (res == -1)
     return -errno;
 
@@ -241,20 +430,14 @@ static int xmp_symlink(const char *from, const char *to) {
 
 static int xmp_rename(const char *from, const char *to, unsigned int flags) {
   int res;
-  char igloo_from[PATH_MAX];
-  char igloo_to[PATH_MAX];
 
-  res = igloo_rebase_path(from, igloo_from);
-  if (res < 0)
-    return res;
-  res = igloo_rebase_path(to, igloo_to);
-  if (res < 0)
-    return res;
+  const char *igloo_from = igloo_rebase_path(from);
+  const char *igloo_to = igloo_rebase_path(to);
 
   if (flags)
     return -EINVAL;
 
-  res = rename(igloo_from, igloo_to);
+  res = renameat(igloo_root_fd, igloo_from, igloo_root_fd, igloo_to);
   if (res == -1)
     return -errno;
 
@@ -263,17 +446,11 @@ static int xmp_rename(const char *from, const char *to, unsigned int flags) {
 
 static int xmp_link(const char *from, const char *to) {
   int res;
-  char igloo_from[PATH_MAX];
-  char igloo_to[PATH_MAX];
 
-  res = igloo_rebase_path(from, igloo_from);
-  if (res < 0)
-    return res;
-  res = igloo_rebase_path(to, igloo_to);
-  if (res < 0)
-    return res;
+  const char *igloo_from = igloo_rebase_path(from);
+  const char *igloo_to = igloo_rebase_path(to);
 
-  res = link(igloo_from, igloo_to);
+  res = linkat(igloo_root_fd, igloo_from, igloo_root_fd, igloo_to, 0);
   if (res == -1)
     return -errno;
 
@@ -283,12 +460,9 @@ static int xmp_link(const char *from, const char *to) {
 static int xmp_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
   (void)fi;
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
-  res = chmod(igloo_path, mode);
+  const char *igloo_path = igloo_rebase_path(path);
+  res = fchmodat(igloo_root_fd, igloo_path, mode, 0);
   if (res == -1)
     return -errno;
 
@@ -299,12 +473,9 @@ static int xmp_chown(const char *path, uid_t uid, gid_t gid,
                      struct fuse_file_info *fi) {
   (void)fi;
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
-  res = lchown(igloo_path, uid, gid);
+  const char *igloo_path = igloo_rebase_path(path);
+  res = fchownat(igloo_root_fd, igloo_path, uid, gid, AT_SYMLINK_NOFOLLOW);
   if (res == -1)
     return -errno;
 
@@ -313,49 +484,61 @@ static int xmp_chown(const char *path, uid_t uid, gid_t gid,
 
 static int xmp_truncate(const char *path, off_t size,
                         struct fuse_file_info *fi) {
+  int fd;
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
+  const char *igloo_path = igloo_rebase_path(path);
 
-  if (fi != NULL)
-    res = ftruncate(fi->fh, size);
-  else
-    res = truncate(igloo_path, size);
-  if (res == -1)
+  /* There's no truncateat(), so the file is opened instead. Like
+     truncate(), refuse anything but a regular file rather than open it,
+     which could block on a FIFO or have side effects on a device. */
+  if (fi == NULL) {
+    struct stat st;
+    if (fstatat(igloo_root_fd, igloo_path, &st, 0) == -1)
+      return -errno;
+    if (!S_ISREG(st.st_mode))
+      return S_ISDIR(st.st_mode) ? -EISDIR : -EINVAL;
+    fd = openat(igloo_root_fd, igloo_path,
+                O_WRONLY | O_NONBLOCK | O_NOCTTY);
+  } else {
+    fd = fi->fh;
+  }
+
+  if (fd == -1)
     return -errno;
 
-  return 0;
+  res = ftruncate(fd, size);
+  if (res == -1)
+    res = -errno;
+
+  if (fi == NULL)
+    close(fd);
+  return res;
 }
 
 static int xmp_create(const char *path, mode_t mode,
                       struct fuse_file_info *fi) {
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
+  const char *igloo_path = igloo_rebase_path(path);
 
-  res = open(igloo_path, fi->flags, mode);
+  res = openat(igloo_root_fd, igloo_path, fi->flags, mode);
   if (res == -1)
     return -errno;
 
+  igloo_passthrough_open(res, fi);
+  igloo_keep_cache(res, fi);
+
   fi->fh = res;
   return 0;
 }
 
 static int xmp_open(const char *path, struct fuse_file_info *fi) {
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
+  const char *igloo_path = igloo_rebase_path(path);
 
-  res = open(igloo_path, fi->flags);
+  res = openat(igloo_root_fd, igloo_path, fi->flags);
   if (res == -1)
     return -errno;
 
@@ -367,6 +550,9 @@ static int xmp_open(const char *path, struct fuse_file_info *fi) {
     fi->parallel_direct_writes = 1;
   }
 
+  igloo_passthrough_open(res, fi);
+  igloo_keep_cache(res, fi);
+
   fi->fh = res;
   return 0;
 }
@@ -375,14 +561,11 @@ static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
                     struct fuse_file_info *fi) {
   int fd;
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
+  const char *igloo_path = igloo_rebase_path(path);
 
   if (fi == NULL)
-    fd = open(igloo_path, O_RDONLY);
+    fd = openat(igloo_root_fd, igloo_path, O_RDONLY);
   else
     fd = fi->fh;
 
@@ -402,14 +585,11 @@ static int xmp_write(const char *path, const char *buf, size_t size,
                      off_t offset, struct fuse_file_info *fi) {
   int fd;
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
+  const char *igloo_path = igloo_rebase_path(path);
 
   if (fi == NULL)
-    fd = open(igloo_path, O_WRONLY);
+    fd = openat(igloo_root_fd, igloo_path, O_WRONLY);
   else
     fd = fi->fh;
 
@@ -425,23 +605,63 @@ static int xmp_write(const char *path, const char *buf, size_t size,
   return res;
 }
 
+static int xmp_read_buf(const char *path, struct fuse_bufvec **bufp,
+                        size_t size, off_t offset, struct fuse_file_info *fi) {
+  struct fuse_bufvec *src;
+
+  (void)path;
+
+  src = malloc(sizeof(struct fuse_bufvec));
+  if (src == NULL)
+    return -ENOMEM;
+
+  *src = FUSE_BUFVEC_INIT(size);
+
+  src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  src->buf[0].fd = fi->fh;
+  src->buf[0].pos = offset;
+
+  *bufp = src;
+
+  return 0;
+}
+
+static int xmp_write_buf(const char *path, struct fuse_bufvec *buf,
+                         off_t offset, struct fuse_file_info *fi) {
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+
+  (void)path;
+
+  dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  dst.buf[0].fd = fi->fh;
+  dst.buf[0].pos = offset;
+
+  return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+}
+
 static int xmp_statfs(const char *path, struct statvfs *stbuf) {
+  int fd;
   int res;
-  char igloo_path[PATH_MAX];
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
+  const char *igloo_path = igloo_rebase_path(path);
 
-  res = statvfs(igloo_path, stbuf);
-  if (res == -1)
+  /* The path may be on a different mount than the root of the
+     passthrough tree */
+  fd = openat(igloo_root_fd, igloo_path, O_PATH);
+  if (fd == -1)
     return -errno;
 
-  return 0;
+  res = fstatvfs(fd, stbuf);
+  if (res == -1)
+    res = -errno;
+
+  close(fd);
+  return res;
 }
 
 static int xmp_release(const char *path, struct fuse_file_info *fi) {
   (void)path;
+  igloo_passthrough_release(fi->fh);
   close(fi->fh);
   return 0;
 }
@@ -462,17 +682,14 @@ static int xmp_ioctl(const char *path, unsigned int cmd, void *arg,
                      void *data) {
   int fd;
   int res;
-  char igloo_path[PATH_MAX];
 
   (void)arg;
   (void)flags;
 
-  res = igloo_rebase_path(path, igloo_path);
-  if (res < 0)
-    return res;
+  const char *igloo_path = igloo_rebase_path(path);
 
   if (fi == NULL)
-    fd = open(igloo_path, O_RDONLY);
+    fd = openat(igloo_root_fd, igloo_path, O_RDONLY);
   else
     fd = fi->fh;
 
@@ -0,0 +1,196 @@
+/*
+ * HyperFS: Hypervisor-managed filesystem
+ * Copyright (C) 2024 Massachusetts Institute of Technology
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ * USA
+ */
+
+// Interface between hyperfs and the host side of the hypercalls it makes
+
+#ifndef HYPERFS_PROTOCOL_H
+#define HYPERFS_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MAGIC_VALUE 0x51ec3692 // crc32("hyperfs")
+#define PACKED __attribute__((packed))
+
+enum {
+  HYP_FILE_OP,
+  HYP_GET_NUM_HYPERFILES,
+  HYP_GET_HYPERFILE_PATHS,
+  HYP_GET_INVALIDATED_PATH,
+  HYP_GET_HYPERFILE_SIZES,
+  HYP_REGISTER_RING,
+  HYP_RING_DOORBELL,
+  HYP_GET_HYPERFILE_PATHS_SIZE,
+  HYP_READ_HYPERFILE_PATHS,
+  HYP_GET_HYPERFILE_CHANGES,
+  HYP_GET_HYPERFILE_PATTERNS,
+  HYP_GET_PROTOCOL_VERSION,
+  HYP_GET_POLL_GENERATION,
+};
+
+// HYP_GET_PROTOCOL_VERSION sets a uint32_t to the PROTOCOL_VERSION the host
+// implements. Hosts from before it leave it at 0, and are only sent
+// HYP_FILE_OP with READ, WRITE, IOCTL and GETATTR, without a handle,
+// HYP_GET_NUM_HYPERFILES and HYP_GET_HYPERFILE_PATHS. Version 1 is everything
+// below.
+#define PROTOCOL_VERSION 1
+
+enum {
+  READ,
+  WRITE,
+  IOCTL,
+  GETATTR,
+  OPEN,
+  RELEASE,
+  WINDOW,
+  SYNC,
+  POLL,
+  LOOKUP,
+  LIST,
+  NUM_FILE_OPS,
+};
+
+// What LOOKUP finds at a path. HYPERFILE_NONE means there's no hyperfile at
+// or beneath it.
+enum { HYPERFILE_NONE, HYPERFILE_FILE, HYPERFILE_DIR };
+
+// LIST fills buf with a directory's entries, if they all fit. Each is a
+// uint32_t name length and a uint32_t HYPERFILE_FILE or HYPERFILE_DIR, in
+// the guest's byte order, followed by the name.
+struct hyperfs_list_entry {
+  uint32_t len;
+  uint32_t kind;
+} PACKED;
+
+enum { HYPERFILE_PATH_MAX = 1024 };
+
+// HYP_READ_HYPERFILE_PATHS copies part of a blob holding every hyperfile path,
+// in the same order as HYP_GET_HYPERFILE_PATHS. Each entry is a uint32_t
+// length in the guest's byte order, followed by that many bytes of path.
+// HYP_GET_HYPERFILE_PATHS_SIZE gives the size of the whole blob.
+enum { PATH_BLOB_CHUNK = 64 << 10 };
+
+// HYP_GET_INVALIDATED_PATH copies the next path whose cached attributes are
+// stale into a HYPERFILE_PATH_MAX buffer, or an empty string if there's none.
+// A buffer still starting with INVALIDATED_PATH_UNANSWERED means the host
+// doesn't implement it.
+#define INVALIDATED_PATH_UNANSWERED '?'
+
+// HYP_GET_HYPERFILE_CHANGES takes a uint64_t generation, a buffer and its
+// size_t size, and a size_t for the size of the list of hyperfiles added or
+// removed since that generation. If the list fits, the host fills the buffer
+// with it and sets the generation to its current one. Entries are laid out
+// like LIST's, with the whole path as the name and HYPERFILE_FILE for an
+// added hyperfile or HYPERFILE_NONE for a removed one. GENERATION_CURRENT
+// asks for just the current generation.
+#define GENERATION_CURRENT UINT64_MAX
+
+// HYP_GET_POLL_GENERATION sets a uint64_t to a count the host increments
+// whenever a hyperfile may have become ready for POLL. Hosts that leave it at
+// GENERATION_CURRENT are asked about each polled hyperfile instead.
+
+// HYP_GET_HYPERFILE_PATTERNS takes a buffer, its size_t size, and a size_t
+// for the size of the host's list of patterns, which it copies into the
+// buffer if it fits. Entries are laid out like the path blob's. A pattern is
+// an absolute path whose components may use fnmatch() wildcards, and every
+// path it matches is a hyperfile.
+
+struct hyperfs_data {
+  int type;
+  const char *path;
+  union {
+    struct {
+      char *buf;
+      size_t size;
+      off_t offset;
+    } PACKED read;
+    struct {
+      const char *buf;
+      size_t size;
+      off_t offset;
+    } PACKED write;
+    struct {
+      unsigned int cmd;
+      void *data;
+    } PACKED ioctl;
+    struct {
+      off_t *size;
+    } PACKED getattr;
+    struct {
+      int flags;
+      unsigned long *handle;
+      // Set nonzero if reads and writes may be buffered (--stream-buffer)
+      int *streamable;
+    } PACKED open;
+    // WINDOW sets size to the size of the window the host backs the
+    // hyperfile with, if it has one. Sent again with buf pointing to that
+    // much locked guest memory, the host sets shared and from then on reads
+    // and writes the hyperfile's contents there directly.
+    struct {
+      size_t *size;
+      char *buf;
+      int *shared;
+    } PACKED window;
+    // SYNC tells the host the guest's writes to a shared window are done,
+    // on fsync (including msync), ioctl and release. to_host is always set.
+    struct {
+      char *buf;
+      size_t size;
+      int to_host;
+    } PACKED sync;
+    struct {
+      unsigned int events;
+      unsigned int *revents;
+    } PACKED poll;
+    struct {
+      int *kind;
+    } PACKED lookup;
+    struct {
+      char *buf;
+      size_t size;
+      // Size of the whole listing
+      size_t *needed;
+    } PACKED list;
+  } PACKED;
+  // Handle the host returned from OPEN, in which case path is NULL, or 0
+  unsigned long handle;
+} PACKED;
+
+// Submission ring shared with the host, so ops from concurrent FUSE workers
+// can be serviced in a single exit. The host sets `enabled` when it accepts
+// the ring in HYP_REGISTER_RING. On HYP_RING_DOORBELL it services every
+// SUBMITTED entry, storing the result and marking it DONE, or leaving it
+// SUBMITTED where it would have returned RETRY.
+enum { RING_SIZE = 64 };
+
+enum { RING_FREE, RING_SUBMITTED, RING_DONE };
+
+struct hyperfs_ring {
+  int enabled;
+  int size;
+  struct {
+    int state;
+    unsigned long result;
+    struct hyperfs_data *data;
+  } PACKED entries[RING_SIZE];
+} PACKED;
+
+#endif